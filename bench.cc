@@ -0,0 +1,517 @@
+#include <benchmark/benchmark.h>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <random>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <filesystem>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "storage.h"
+#include "tokenizer.h"
+#include "wordcount_table.h"
+#include "record_block.h"
+#include "wordcount.h"
+
+using namespace std;
+
+// Benchmarks of the word count hot paths and of whole jobs on a local cluster. The corpus is configured through the
+// environment:
+//   BENCH_CORPUS_MB     size of the corpus in MB (default 16)
+//   BENCH_VOCABULARY    number of distinct words of the synthetic corpus (default 100000)
+//   BENCH_SKEW          Zipf exponent of the word frequencies, 0 for uniform (default 1.0)
+//   BENCH_TEXT          file of real text used instead of the synthetic corpus, repeated up to the corpus size
+//   BENCH_SLAVE_THREADS map threads of each slave in the end to end benchmark (default 2)
+//   BENCH_SPLIT_MB      map split size of the end to end benchmark (default 4)
+// Results are written as JSON to bench_results.json unless --benchmark_out is given.
+
+static int64_t EnvInt(const char *name, int64_t defaultValue)
+{
+    const char *value = getenv(name);
+    return value ? atoll(value) : defaultValue;
+}
+
+static double EnvDouble(const char *name, double defaultValue)
+{
+    const char *value = getenv(name);
+    return value ? atof(value) : defaultValue;
+}
+
+// Text of words drawn from a Zipf distribution over a random vocabulary, separated mostly by spaces with line breaks,
+// tabs and punctuation mixed in
+static string SyntheticCorpus(int64_t size, int64_t vocabularySize, double skew)
+{
+    mt19937_64 random(42);
+    uniform_int_distribution<int> length(1, 12), letter('a', 'z');
+    vector<string> vocabulary(vocabularySize);
+    for (auto &word : vocabulary)
+    {
+        word.resize(length(random));
+        for (auto &c : word)
+            c = letter(random);
+    }
+    vector<double> cumulative(vocabularySize);
+    double total = 0;
+    for (int64_t i = 0; i < vocabularySize; i++)
+    {
+        total += 1 / pow(i + 1, skew);
+        cumulative[i] = total;
+    }
+    uniform_real_distribution<double> uniform(0, total);
+    uniform_int_distribution<int> separator(0, 99);
+
+    string corpus;
+    corpus.reserve(size + 16);
+    while (corpus.size() < size)
+    {
+        corpus += vocabulary[lower_bound(cumulative.begin(), cumulative.end(), uniform(random)) - cumulative.begin()];
+        int kind = separator(random);
+        corpus += kind < 85 ? " " : kind < 95 ? "\n" : kind < 97 ? "\t" : kind < 99 ? ", " : ".\r\n";
+    }
+    return corpus;
+}
+
+static const string &Corpus()
+{
+    static string corpus = []()
+    {
+        int64_t size = EnvInt("BENCH_CORPUS_MB", 16) * 1024 * 1024;
+        const char *textPath = getenv("BENCH_TEXT");
+        if (!textPath)
+            return SyntheticCorpus(size, EnvInt("BENCH_VOCABULARY", 100000), EnvDouble("BENCH_SKEW", 1.0));
+        ifstream textFile(textPath, ios::binary);
+        stringstream text;
+        text << textFile.rdbuf();
+        string corpus;
+        while (corpus.size() < size && !text.str().empty())
+            corpus += text.str();
+        corpus.resize(min<int64_t>(corpus.size(), size));
+        return corpus;
+    }();
+    return corpus;
+}
+
+static const vector<string_view> &CorpusWords()
+{
+    static vector<string_view> words = []()
+    {
+        DelimiterSet delimiters;
+        vector<string_view> words;
+        const string &corpus = Corpus();
+        size_t i = 0;
+        while (true)
+        {
+            i += delimiters.FindNonDelimiter(corpus.data() + i, corpus.size() - i);
+            if (i == corpus.size())
+                break;
+            size_t length = delimiters.FindDelimiter(corpus.data() + i, corpus.size() - i);
+            words.emplace_back(corpus.data() + i, length);
+            i += length;
+        }
+        return words;
+    }();
+    return words;
+}
+
+// Input file over a string in memory, mapped like a local file so no time goes into copying
+class MemoryInputFile : public InputFile
+{
+    const string &data;
+
+public:
+    MemoryInputFile(const string &data) : data(data) {}
+
+    int64_t Size() override { return data.size(); }
+
+    int64_t Read(int64_t offset, char *buffer, int64_t length) override
+    {
+        length = max<int64_t>(0, min<int64_t>(length, data.size() - offset));
+        memcpy(buffer, data.data() + offset, length);
+        return length;
+    }
+
+    const char *Map(int64_t offset, int64_t length) override { return data.data() + offset; }
+};
+
+class NullOutputFile : public OutputFile
+{
+public:
+    bool Write(const char *data, int64_t length) override { return true; }
+    bool Close() override { return true; }
+};
+
+// ---------------------------------------------------------------- Tokenization
+
+static void BM_Tokenize(benchmark::State &state, DelimiterSet::Implementation implementation, bool punctuation)
+{
+    DelimiterSet delimiters(string(DelimiterSet::whitespace) + (punctuation ? DelimiterSet::punctuation : ""), implementation);
+    if (!delimiters.Supports(implementation))
+    {
+        state.SkipWithError("Scanner not supported for these delimiters on this CPU");
+        return;
+    }
+    const string &corpus = Corpus();
+    for (auto _ : state)
+    {
+        int64_t words = 0;
+        size_t i = 0;
+        while (true)
+        {
+            i += delimiters.FindNonDelimiter(corpus.data() + i, corpus.size() - i);
+            if (i == corpus.size())
+                break;
+            i += delimiters.FindDelimiter(corpus.data() + i, corpus.size() - i);
+            ++words;
+        }
+        benchmark::DoNotOptimize(words);
+    }
+    state.SetBytesProcessed(state.iterations() * corpus.size());
+}
+BENCHMARK_CAPTURE(BM_Tokenize, Scalar, DelimiterSet::SCALAR, false);
+BENCHMARK_CAPTURE(BM_Tokenize, Sse2, DelimiterSet::SSE2, false);
+BENCHMARK_CAPTURE(BM_Tokenize, Avx2, DelimiterSet::AVX2, false);
+BENCHMARK_CAPTURE(BM_Tokenize, ScalarPunctuation, DelimiterSet::SCALAR, true);
+BENCHMARK_CAPTURE(BM_Tokenize, Avx2Punctuation, DelimiterSet::AVX2, true);
+
+// Whole map range: tokenizing, combining and writing the partitioned record blocks.
+// Arguments: combiner budget in MB (0 passes every word through), codec, number of partitions
+static void BM_CountWords(benchmark::State &state)
+{
+    MemoryInputFile input(Corpus());
+    DelimiterSet delimiters;
+    TaskCounters counters;
+    for (auto _ : state)
+    {
+        vector<unique_ptr<OutputFile>> outputFiles;
+        for (int i = 0; i < state.range(2); i++)
+            outputFiles.emplace_back(new NullOutputFile());
+        MapOutput output(outputFiles, BlockCodec(state.range(1)));
+        Combiner combiner(output, state.range(0) * 1024 * 1024, counters);
+        CountWords(input, 0, input.Size(), 4 * 1024 * 1024, delimiters, combiner, counters);
+        combiner.Flush();
+    }
+    state.SetBytesProcessed(state.iterations() * input.Size());
+    // Phase times as the task metrics of a slave report them, in seconds per iteration
+    state.counters["tokenizeSeconds"] = benchmark::Counter(counters.tokenizeNanos / 1e9, benchmark::Counter::kAvgIterations);
+    state.counters["aggregateSeconds"] = benchmark::Counter(counters.aggregateNanos / 1e9, benchmark::Counter::kAvgIterations);
+    state.counters["writeSeconds"] = benchmark::Counter(counters.writeNanos / 1e9, benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_CountWords)->ArgNames({"budgetMB", "codec", "partitions"})->Args({64, CODEC_NONE, 4})->Args({64, CODEC_ZLIB, 4})->Args({0, CODEC_NONE, 4})->Args({1, CODEC_ZLIB, 4})->Unit(benchmark::kMillisecond);
+
+// ---------------------------------------------------------------- Counting
+
+static void BM_CountWordCountTable(benchmark::State &state)
+{
+    const vector<string_view> &words = CorpusWords();
+    for (auto _ : state)
+    {
+        WordCountTable counts;
+        for (auto word : words)
+            counts.Add(word);
+        benchmark::DoNotOptimize(counts.Size());
+    }
+    state.SetItemsProcessed(state.iterations() * words.size());
+}
+BENCHMARK(BM_CountWordCountTable)->Unit(benchmark::kMillisecond);
+
+// Baselines the table replaced
+static void BM_CountUnorderedMap(benchmark::State &state)
+{
+    const vector<string_view> &words = CorpusWords();
+    for (auto _ : state)
+    {
+        unordered_map<string, int64_t> counts;
+        string key;
+        for (auto word : words)
+        {
+            key.assign(word.data(), word.size());
+            ++counts[key];
+        }
+        benchmark::DoNotOptimize(counts.size());
+    }
+    state.SetItemsProcessed(state.iterations() * words.size());
+}
+BENCHMARK(BM_CountUnorderedMap)->Unit(benchmark::kMillisecond);
+
+static void BM_CountMap(benchmark::State &state)
+{
+    const vector<string_view> &words = CorpusWords();
+    for (auto _ : state)
+    {
+        map<string, int> counts;
+        for (auto word : words)
+            ++counts[string(word)];
+        benchmark::DoNotOptimize(counts.size());
+    }
+    state.SetItemsProcessed(state.iterations() * words.size());
+}
+BENCHMARK(BM_CountMap)->Unit(benchmark::kMillisecond);
+
+// ---------------------------------------------------------------- Output formatting
+
+static const WordCountTable &CorpusCounts()
+{
+    static WordCountTable counts = []()
+    {
+        WordCountTable counts;
+        for (auto word : CorpusWords())
+            counts.Add(word);
+        return counts;
+    }();
+    return counts;
+}
+
+// Sorted "word count" lines as written to the final output
+static void BM_FormatText(benchmark::State &state)
+{
+    const WordCountTable &counts = CorpusCounts();
+    for (auto _ : state)
+    {
+        string output;
+        for (auto &word : counts.Sorted())
+        {
+            output.append(word.first.data(), word.first.size());
+            output += ' ';
+            output += to_string(word.second);
+            output += '\n';
+        }
+        benchmark::DoNotOptimize(output.data());
+    }
+    state.SetItemsProcessed(state.iterations() * counts.Size());
+}
+BENCHMARK(BM_FormatText)->Unit(benchmark::kMillisecond);
+
+static string EncodeBlocks(const WordCountTable &counts, BlockCodec codec)
+{
+    RecordBlockBuilder block;
+    string blocks;
+    counts.ForEach([&](string_view word, int64_t count)
+                   {
+                       block.Add(word, count);
+                       if (block.RawSize() >= 64 * 1024)
+                           block.Finish(codec, blocks); });
+    if (block.RecordCount() > 0)
+        block.Finish(codec, blocks);
+    return blocks;
+}
+
+static void BM_EncodeBlocks(benchmark::State &state)
+{
+    const WordCountTable &counts = CorpusCounts();
+    int64_t bytes = 0;
+    for (auto _ : state)
+    {
+        string blocks = EncodeBlocks(counts, BlockCodec(state.range(0)));
+        bytes = blocks.size();
+        benchmark::DoNotOptimize(blocks.data());
+    }
+    state.SetItemsProcessed(state.iterations() * counts.Size());
+    state.counters["encodedBytes"] = bytes;
+}
+BENCHMARK(BM_EncodeBlocks)->ArgName("codec")->Arg(CODEC_NONE)->Arg(CODEC_ZLIB)->Unit(benchmark::kMillisecond);
+
+static void BM_DecodeBlocks(benchmark::State &state)
+{
+    const WordCountTable &counts = CorpusCounts();
+    string blocks = EncodeBlocks(counts, BlockCodec(state.range(0)));
+    string scratch;
+    for (auto _ : state)
+    {
+        int64_t total = 0;
+        DecodeBlocks(blocks.data(), blocks.size(), scratch, [&total](string_view word, int64_t count)
+                     { total += count; });
+        benchmark::DoNotOptimize(total);
+    }
+    state.SetItemsProcessed(state.iterations() * counts.Size());
+    state.SetBytesProcessed(state.iterations() * blocks.size());
+}
+BENCHMARK(BM_DecodeBlocks)->ArgName("codec")->Arg(CODEC_NONE)->Arg(CODEC_ZLIB)->Unit(benchmark::kMillisecond);
+
+// ---------------------------------------------------------------- End to end
+
+// Master and slaves running as separate processes on this machine against a temporary local storage directory. The
+// master is driven through its interactive interface on a pipe.
+class LocalCluster
+{
+    string root;
+    pid_t master;
+    FILE *masterInput;
+    FILE *masterOutput;
+    vector<pid_t> slaves;
+
+    static pid_t Spawn(const vector<string> &args, int stdinFd, int stdoutFd)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            dup2(stdinFd, 0);
+            dup2(stdoutFd, 1);
+            dup2(stdoutFd, 2);
+            vector<char *> argv;
+            for (auto &arg : args)
+                argv.push_back(const_cast<char *>(arg.c_str()));
+            argv.push_back(nullptr);
+            execv(argv[0], argv.data());
+            _exit(127);
+        }
+        return pid;
+    }
+
+    // Reading master output up to and including the first line containing text, false if the master went away
+    bool WaitForMaster(const string &text)
+    {
+        char *line = nullptr;
+        size_t capacity = 0;
+        bool found = false;
+        while (!found && getline(&line, &capacity, masterOutput) > 0)
+            found = strstr(line, text.c_str()) != nullptr;
+        free(line);
+        return found;
+    }
+
+public:
+    LocalCluster(const string &corpus, int numOfSlaves, int slaveThreads, int splitSizeMB) : master(-1), masterInput(nullptr), masterOutput(nullptr)
+    {
+        char rootTemplate[] = "/tmp/mapreduce-bench-XXXXXX";
+        root = mkdtemp(rootTemplate);
+        filesystem::create_directories(root + "/files");
+        ofstream(root + "/files/US_AirLines.txt", ios::binary) << corpus;
+
+        int toMaster[2], fromMaster[2];
+        if (pipe(toMaster) != 0 || pipe(fromMaster) != 0)
+            return;
+        master = Spawn({MASTER_BINARY, "local:" + root}, toMaster[0], fromMaster[1]);
+        close(toMaster[0]);
+        close(fromMaster[1]);
+        masterInput = fdopen(toMaster[1], "w");
+        masterOutput = fdopen(fromMaster[0], "r");
+        fprintf(masterInput, "6\n%d\n", splitSizeMB);
+        fflush(masterInput);
+        this_thread::sleep_for(chrono::milliseconds(500));
+
+        int devNull = open("/dev/null", O_RDWR);
+        for (int i = 0; i < numOfSlaves; i++)
+        {
+            string port = to_string(50100 + i);
+            string log = root + "/slave-" + port + ".log";
+            int logFd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            slaves.push_back(Spawn({SLAVE_BINARY, port, "local:" + root, to_string(slaveThreads), root + "/slave-" + port}, devNull, logFd));
+            close(logFd);
+            // Slaves are started one after the other so each has registered before the job starts
+            for (int wait = 0; wait < 100; wait++)
+            {
+                ifstream logFile(log);
+                stringstream logText;
+                logText << logFile.rdbuf();
+                if (logText.str().find("registered") != string::npos)
+                    break;
+                this_thread::sleep_for(chrono::milliseconds(50));
+            }
+        }
+        close(devNull);
+    }
+
+    ~LocalCluster()
+    {
+        if (masterInput)
+        {
+            fputs("5\n", masterInput);
+            fclose(masterInput);
+        }
+        if (masterOutput)
+            fclose(masterOutput);
+        for (pid_t slave : slaves)
+            kill(slave, SIGKILL);
+        for (pid_t slave : slaves)
+            waitpid(slave, nullptr, 0);
+        if (master > 0)
+        {
+            kill(master, SIGKILL);
+            waitpid(master, nullptr, 0);
+        }
+        filesystem::remove_all(root);
+    }
+
+    // Marking the input as changed in place, so the next job maps every split again instead of reusing the map output
+    // the master has kept in its manifest from the job before
+    void TouchInput()
+    {
+        filesystem::last_write_time(root + "/files/US_AirLines.txt", filesystem::file_time_type::clock::now());
+    }
+
+    // Running one word count job with top K, false if the master went away
+    bool RunJob(int k)
+    {
+        if (!masterInput)
+            return false;
+        fprintf(masterInput, "2\n%d\n", k);
+        fflush(masterInput);
+        return WaitForMaster("Top " + to_string(k) + " Words") && WaitForMaster("1. For Seeing All Slaves Status.");
+    }
+};
+
+// Arguments: number of slaves, and whether every job runs cold and maps all of its input (1) or, after the first one,
+// reuses the map output of the job before it (0)
+static void BM_EndToEnd(benchmark::State &state)
+{
+    const string &corpus = Corpus();
+    LocalCluster cluster(corpus, state.range(0), EnvInt("BENCH_SLAVE_THREADS", 2), EnvInt("BENCH_SPLIT_MB", 4));
+    bool cold = state.range(1);
+    for (auto _ : state)
+    {
+        if (cold)
+        {
+            state.PauseTiming();
+            cluster.TouchInput();
+            state.ResumeTiming();
+        }
+        if (!cluster.RunJob(10))
+        {
+            state.SkipWithError("Master exited during the job");
+            break;
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * corpus.size());
+}
+BENCHMARK(BM_EndToEnd)->ArgNames({"slaves", "cold"})->Args({1, 1})->Args({2, 1})->Args({4, 1})->Args({2, 0})->Iterations(3)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+int main(int argc, char **argv)
+{
+    // Writing JSON results for tracking regressions across commits unless the caller chose an output file
+    vector<char *> args(argv, argv + argc);
+    string defaultOut = "--benchmark_out=bench_results.json";
+    string defaultFormat = "--benchmark_out_format=json";
+    if (none_of(args.begin(), args.end(), [](char *arg)
+                { return strncmp(arg, "--benchmark_out=", 16) == 0; }))
+    {
+        args.push_back(&defaultOut[0]);
+        args.push_back(&defaultFormat[0]);
+    }
+    int numOfArgs = args.size();
+    benchmark::Initialize(&numOfArgs, args.data());
+    if (benchmark::ReportUnrecognizedArguments(numOfArgs, args.data()))
+        return 1;
+
+    benchmark::AddCustomContext("git_commit", BENCH_GIT_COMMIT);
+    benchmark::AddCustomContext("corpus_bytes", to_string(Corpus().size()));
+    benchmark::AddCustomContext("corpus", getenv("BENCH_TEXT") ? getenv("BENCH_TEXT") : "synthetic");
+    benchmark::AddCustomContext("vocabulary", to_string(EnvInt("BENCH_VOCABULARY", 100000)));
+    benchmark::AddCustomContext("skew", to_string(EnvDouble("BENCH_SKEW", 1.0)));
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
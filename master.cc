@@ -7,9 +7,21 @@
 #include <vector>
 #include <map>
 #include <algorithm>
-#include <hdfs.h>
 #include <string>
+#include <queue>
+#include <mutex>
+#include <deque>
+#include <condition_variable>
+#include <iomanip>
 #include <sstream>
+#include <tuple>
+#include <set>
+#include <cstdio>
+#include <fnmatch.h>
+#include <grpcpp/alarm.h>
+#include "storage.h"
+#include "tokenizer.h"
+#include "record_block.h"
 
 using grpc::ClientContext;
 using grpc::Server;
@@ -18,29 +30,177 @@ using grpc::ServerContext;
 using grpc::Status;
 using masterslave::ControlSignalRequest;
 using masterslave::ControlSignalResponse;
+using masterslave::GetMetricsRequest;
+using masterslave::GetMetricsResponse;
+using masterslave::TaskMetrics;
+using masterslave::DeregisterSlaveRequest;
+using masterslave::DeregisterSlaveResponse;
 using masterslave::MasterService;
 using masterslave::QuerySlaveStatusRequest;
 using masterslave::QuerySlaveStatusResponse;
 using masterslave::RegisterSlaveRequest;
 using masterslave::RegisterSlaveResponse;
 using masterslave::SlaveService;
+using masterslave::GetJobStatusRequest;
+using masterslave::GetJobStatusResponse;
+using masterslave::JobState;
+using masterslave::SubmitJobRequest;
+using masterslave::SubmitJobResponse;
 using masterslave::UpdateControlIntervalRequest;
 using masterslave::UpdateControlIntervalResponse;
 
+using masterslave::MapLocation;
+using masterslave::WordCount;
 using masterslave::MapRequest;
+using masterslave::Segment;
 using masterslave::MapResponse;
 using masterslave::ReduceRequest;
 using masterslave::ReduceResponse;
+using masterslave::WaitForMapsRequest;
+using masterslave::WaitForMapsResponse;
+using masterslave::ReportLostMapOutputRequest;
+using masterslave::ReportLostMapOutputResponse;
 
 using namespace std;
 
+enum TaskType
+{
+    MAP_TASK,
+    REDUCE_TASK
+};
+
+struct TaskGroup;
+struct TaskCall;
+struct Job;
+
+// Size and modification time of an input file as a job listed it
+struct FileVersion
+{
+    int64_t size;
+    int64_t modificationTime;
+};
+
+// A map or reduce task with the request sent to the slave running it
+struct Task
+{
+    TaskType type;
+    int id; // Chunk number of a map task, partition of a reduce task
+    MapRequest mapRequest;
+    ReduceRequest reduceRequest;
+    bool completed = false;
+    TaskGroup *group;
+    int attempts = 0;                 // Attempts started so far, numbering the output of each attempt
+    int failures = 0;                 // Attempts that failed or ran past their deadline
+    int64_t inputBytes = 0;           // Bytes the task reads, the deadline of its attempts is scaled to them
+    vector<TaskCall *> runningCalls;  // Attempts in flight, more than one once the task has been speculated
+    MapLocation location;             // Where the output of a completed map task is served from
+    vector<WordCount> topWords;       // Most frequent words of the partition of a completed reduce task
+    chrono::steady_clock::time_point started; // Start of the oldest attempt in flight
+    double duration = 0;              // Seconds the completing attempt took, from sending the request to its response
+    uint64_t fingerprint = 0;         // Of the split of a map task, recorded in the manifest once the task completes
+    vector<FileVersion> versions;     // Of the files of the split of a map task, recorded along with the fingerprint
+};
+
+// Tasks of one phase of a job. progress is notified whenever a task of the group completes.
+struct TaskGroup
+{
+    string name;
+    Job *job;
+    vector<Task> tasks;
+    int completed = 0;
+    bool failed = false; // A task has failed too often, the job is given up
+    condition_variable progress;
+    vector<double> durations; // Seconds taken by the completed tasks, their median is the bar for stragglers
+};
+
+// What the master sees of a job, reported together with the metrics slaves keep of its tasks
+struct JobStats
+{
+    double mapSeconds = 0;
+    double reduceSeconds = 0;
+    double reduceTailSeconds = 0; // Part of the reduce phase after the last map had completed
+    map<pair<string, int>, double> taskSeconds; // Duration of each completed task by type ("Map", "Reduce") and id
+};
+
+// A job submitted through SubmitJob or the menu. Jobs wait in a queue and several of them run at once.
+struct Job
+{
+    int64_t id;
+    SubmitJobRequest request;
+    string workDirectory; // Directory on the local disk of the slaves holding the map output of the job
+    int64_t splitSize;    // Settings of the master when the job was queued, changing them only affects later jobs
+    string delimiters;
+    JobState state;
+    string error; // Why the job failed
+    TaskGroup mapTasks;
+    TaskGroup reduceTasks;
+    vector<MapLocation> mapLocations; // Output of the completed maps in order of completion, reducers are told of it
+    int cachedSplits = 0;             // Splits whose map output is reused from an earlier job instead of mapped again
+    set<string> reusedDirectories;    // Work directories of the earlier jobs holding that output, kept while the job runs
+    chrono::steady_clock::time_point mapsCompleted; // When the last map completed, deadlines of reducers run from then
+    vector<WordCount> topWords;
+    JobStats stats;
+};
+
+// Split as partitioned for a number of reducers with a set of delimiters and split points: (segments, number of
+// partitions, PartitioningHash). The segments are written as offset, length and path of each, separated by tabs.
+typedef tuple<string, int64_t, uint64_t> SplitKey;
+
+// Where the map output of a split is kept, along with the fingerprint of the split content it was computed from
+struct ManifestEntry
+{
+    uint64_t fingerprint;
+    vector<FileVersion> versions; // Of the file of each segment of the split, in the order of the segments
+    string address;   // Slave holding the map output
+    string directory; // Work directory of the job that mapped the split
+    int64_t chunkNumber;
+};
+
+// State of one asynchronous heartbeat, used as the tag of its completion
+struct HeartbeatCall
+{
+    int slaveID;
+    shared_ptr<SlaveService::Stub> stub;
+    ClientContext context;
+    ControlSignalRequest request;
+    ControlSignalResponse response;
+    Status status;
+    unique_ptr<grpc::ClientAsyncResponseReader<ControlSignalResponse>> reader;
+};
+
+// State of one asynchronous Map or Reduce RPC, used as the tag of its completion on the CompletionQueue
+struct TaskCall
+{
+    Task *task;
+    int slaveID;
+    int attempt;
+    chrono::steady_clock::time_point started;
+    bool overdue = false;   // Cancelled for running past its deadline
+    bool lost = false;      // Cancelled because its slave was given up on, not counted as a failure of the task
+    bool preempted = false; // Early reducer cancelled to free its slot for a map, not counted as a failure either
+    shared_ptr<SlaveService::Stub> stub; // Keeps the stub alive until the RPC has completed
+    ClientContext context;
+    Status status;
+    MapResponse mapResponse;
+    ReduceResponse reduceResponse;
+    unique_ptr<grpc::ClientAsyncResponseReader<MapResponse>> mapReader;
+    unique_ptr<grpc::ClientAsyncResponseReader<ReduceResponse>> reduceReader;
+};
+
 struct Slave
 {
     string address;
-    bool responsive;
-    bool isFree;
+    bool responsive; // False from the first missed heartbeat until the slave answers again
+    int slots;        // Tasks the slave runs at once, as it registered with
+    int runningTasks; // Map and Reduce RPCs in flight to the slave
     Status SignalStatus;
     Status TaskStatus;
+    int missedHeartbeats;
+    ControlSignalResponse load; // Load reported with the last heartbeat answered
+    // Long-lived connection reused by every RPC to this slave, released when the slave deregisters
+    shared_ptr<grpc::Channel> channel;
+    shared_ptr<SlaveService::Stub> stub;
+    vector<string> removeDirectories; // Job directories to remove from the local disk of the slave with the next heartbeat
 };
 
 class Master : public MasterService::Service
@@ -48,10 +208,74 @@ class Master : public MasterService::Service
     chrono::seconds controlInt;
     chrono::seconds timeoutInt;
     int noOfSlaves;
+    int nextSlaveID;
     map<int, Slave> Slaves;
+    mutex stateMutex; // Guards Slaves, their connections and the task state of the scheduler
+
+    grpc::CompletionQueue taskQueue; // Completions of Map and Reduce RPCs and wake ups of the scheduler
+    deque<Task *> pendingTasks;      // Tasks waiting for a free slave, in submission order
+    bool wakePending;                // A wake up alarm is already queued on taskQueue
+    unique_ptr<grpc::Alarm> wakeAlarm;
+    vector<TaskGroup *> runningGroups; // Groups with tasks in flight, scanned for stragglers
+
+    // Jobs by id. The last maxFinishedJobs finished jobs are kept, in order of finishing, so their status can still be
+    // queried.
+    map<int64_t, shared_ptr<Job>> jobs;
+    deque<int64_t> finishedJobs;
+    static const size_t maxFinishedJobs = 256;
+    int64_t nextJobID;
+    deque<shared_ptr<Job>> jobQueue; // Jobs waiting for one of the job threads
+    condition_variable jobQueued;
+    condition_variable jobFinished;
+    condition_variable mapCompleted; // A map of any job has completed, wakes WaitForMaps
+
+    // Map output of every split mapped so far. A job over a split whose content has not changed since reuses the
+    // output instead of mapping the split again, so re-running a job over files that have not changed maps nothing
+    // again. Entries are dropped once their output is lost or superseded, and the work directory of a job is removed
+    // from the slaves once no entry and no running job needs it. Kept in manifestPath of the storage so it outlives
+    // the master.
+    map<SplitKey, ManifestEntry> manifest;
+    mutex manifestMutex; // Serializes writing the manifest file, the map itself is guarded by stateMutex
+    const string manifestPath = "/jobs/manifest.txt";
+    static constexpr int64_t fingerprintSample = 4096; // Bytes hashed at each end of a split and after it
+    static constexpr int sampleReads = 128;            // Windows of the input read for the split points of an ordered job
+    static constexpr int64_t sampleWindow = 32 * 1024;
+
+    // Speculative execution: once speculationStart of a group's tasks have completed, a task running for longer than
+    // speculationSlowdown times the median task duration gets a second attempt on another slave with a free slot
+    double speculationStart;
+    double speculationSlowdown;
+    int64_t combinerBudget; // Memory in bytes each map task may use for aggregating word counts, 0 disables the combiner
+    int64_t reduceBudget;   // Memory in bytes a reduce task may hold word counts in before spilling them, 0 for no limit
+    // Reducers of a job are started once reduceSlowstart of its maps have completed and fetch map output while the
+    // other maps run. They hold their slots while waiting, so at most earlyReduceShare of all slots go to reducers of
+    // jobs still mapping, leaving the rest to the maps they wait for.
+    double reduceSlowstart;
+    double earlyReduceShare;
+    // Every attempt has a deadline of taskTimeout plus a second for every taskThroughput bytes its task reads, an attempt
+    // of a reduce task counting from when the last map of its job completed. Attempts past their deadline are
+    // cancelled, and a task whose attempts have failed maxTaskFailures times fails its job. A slave missing
+    // lostAfterHeartbeats heartbeats in a row is given up on, see LoseSlave.
+    chrono::seconds taskTimeout;
+    int64_t taskThroughput;
+    static const int maxTaskFailures = 4;
+    static const int lostAfterHeartbeats = 3;
+    static constexpr chrono::seconds mapWaitTimeout = chrono::seconds(5); // Longest WaitForMaps blocks for
+    // Settings changed through the menu while jobs run, guarded by stateMutex and copied into every job as it is queued
+    int64_t splitSize;      // Bytes of input per map task, 0 splits on the block size of the storage
+    static const int64_t defaultSplitSize = 64 * 1024 * 1024; // Used when the storage has no block size
+    string delimiters;      // Characters separating words in addition to whitespace
+    BlockCodec intermediateCodec; // Compression of map output blocks
+    int64_t readBufferSize;       // Bytes slaves read from a file at once, while the next buffer is prefetched
+    unique_ptr<Storage> storage;
 
 public:
-    Master() : controlInt(chrono::seconds(1)), timeoutInt(chrono::seconds(4)), noOfSlaves(0) {}
+    static const int maxRunningJobs = 4; // Jobs sharing the cluster at once, further jobs wait in the queue
+
+    Master(unique_ptr<Storage> storage) : controlInt(chrono::seconds(1)), timeoutInt(chrono::seconds(4)), noOfSlaves(0), nextSlaveID(0), wakePending(false), nextJobID(1), speculationStart(0.75), speculationSlowdown(1.5), combinerBudget(64 * 1024 * 1024), reduceBudget(256 * 1024 * 1024), reduceSlowstart(0.05), earlyReduceShare(0.5), taskTimeout(30), taskThroughput(1024 * 1024), splitSize(0), intermediateCodec(CODEC_ZLIB), readBufferSize(4 * 1024 * 1024), storage(move(storage))
+    {
+        LoadManifest();
+    }
 
     // RPC Call for Updating Control Interval (Implemented in Assignment 2)
     Status UpdateControlInterval(ServerContext *context, const UpdateControlIntervalRequest *request, UpdateControlIntervalResponse *response) override
@@ -75,6 +299,7 @@ public:
     Status QuerySlaveStatus(ServerContext *context, const QuerySlaveStatusRequest *request, QuerySlaveStatusResponse *response) override
     {
         string slaveAddress = request->address();
+        lock_guard<mutex> lock(stateMutex);
         auto slavesItr = Slaves.begin();
         response->set_responsive(false);
         while (slavesItr != Slaves.end())
@@ -84,6 +309,7 @@ public:
                 response->set_responsive(slavesItr->second.responsive);
                 break;
             }
+            ++slavesItr;
         }
         return Status::OK;
     }
@@ -93,363 +319,1627 @@ public:
     {
         // Adding Slave to the Slaves Map and Responding whether it is successfully added
         string addr = request->address();
-        Slaves[noOfSlaves] = {addr, true, true};
+        lock_guard<mutex> lock(stateMutex);
+        // A slave registering again at the same address has restarted, the map output of the old process is gone
+        for (auto slavesItr = Slaves.begin(); slavesItr != Slaves.end();)
+        {
+            if (slavesItr->second.address != addr)
+            {
+                ++slavesItr;
+                continue;
+            }
+            cout << "Slave: " << slavesItr->first << " with Address: " << addr << " has restarted" << endl;
+            if (slavesItr->second.missedHeartbeats < lostAfterHeartbeats)
+                LoseSlave(slavesItr->first);
+            slavesItr = Slaves.erase(slavesItr);
+            --noOfSlaves;
+        }
+        Slave &slave = Slaves[nextSlaveID];
+        slave.address = addr;
+        slave.responsive = true;
+        slave.slots = request->slots() > 0 ? request->slots() : 1;
+        slave.runningTasks = 0;
+        slave.missedHeartbeats = 0;
+        slave.load.set_freeslots(1);
+        Connect(slave);
+        ++nextSlaveID;
         ++noOfSlaves;
+        WakeScheduler();
         response->set_success(true);
         return Status::OK;
     }
 
-    // Sending control signals to check whether the registered slaves are resposive or not
+    // A slave that shuts down calls this RPC so it stops getting tasks and its connection is torn down
+    Status DeregisterSlave(ServerContext *context, const DeregisterSlaveRequest *request, DeregisterSlaveResponse *response) override
+    {
+        lock_guard<mutex> lock(stateMutex);
+        response->set_success(false);
+        for (auto slavesItr = Slaves.begin(); slavesItr != Slaves.end(); ++slavesItr)
+        {
+            if (slavesItr->second.address == request->address())
+            {
+                cout << "Slave: " << slavesItr->first << " with Address: " << request->address() << " has deregistered" << endl;
+                if (slavesItr->second.missedHeartbeats < lostAfterHeartbeats)
+                    LoseSlave(slavesItr->first);
+                Slaves.erase(slavesItr);
+                --noOfSlaves;
+                response->set_success(true);
+                break;
+            }
+        }
+        return Status::OK;
+    }
+
+    // Creating the channel and stub of a slave, the channel starts connecting right away so the first task does not
+    // pay for the handshake
+    void Connect(Slave &slave)
+    {
+        slave.channel = grpc::CreateChannel(slave.address, grpc::InsecureChannelCredentials());
+        slave.stub = SlaveService::NewStub(slave.channel);
+        slave.channel->GetState(true);
+    }
+
+    // Returns the cached stub of a slave, or nullptr if the slave has deregistered. The shared_ptr keeps the stub
+    // alive for an RPC in flight even if the slave deregisters meanwhile.
+    shared_ptr<SlaveService::Stub> GetStub(int SlaveID)
+    {
+        lock_guard<mutex> lock(stateMutex);
+        auto slavesItr = Slaves.find(SlaveID);
+        if (slavesItr == Slaves.end())
+            return nullptr;
+        if (slavesItr->second.channel->GetState(false) == GRPC_CHANNEL_SHUTDOWN)
+            Connect(slavesItr->second);
+        return slavesItr->second.stub;
+    }
+
+    // Called after an RPC failed because the slave was unavailable. A fresh channel reconnects immediately instead
+    // of waiting out the reconnect backoff of the old one.
+    void Reconnect(int SlaveID)
+    {
+        lock_guard<mutex> lock(stateMutex);
+        auto slavesItr = Slaves.find(SlaveID);
+        if (slavesItr != Slaves.end())
+            Connect(slavesItr->second);
+    }
+
+    // Connection health for the scheduler: a channel that failed to connect is not given tasks until it recovers
+    bool IsConnected(const Slave &slave)
+    {
+        grpc_connectivity_state state = slave.channel->GetState(true);
+        return state != GRPC_CHANNEL_TRANSIENT_FAILURE && state != GRPC_CHANNEL_SHUTDOWN;
+    }
+
+    string ConnectionState(const Slave &slave)
+    {
+        switch (slave.channel->GetState(false))
+        {
+        case GRPC_CHANNEL_IDLE:
+            return "Idle";
+        case GRPC_CHANNEL_CONNECTING:
+            return "Connecting";
+        case GRPC_CHANNEL_READY:
+            return "Connected";
+        case GRPC_CHANNEL_TRANSIENT_FAILURE:
+            return "Connection Failed";
+        default:
+            return "Shut Down";
+        }
+    }
+
+    // Sending heartbeats to all registered slaves at once, each with the timeout interval as deadline, so one slow or
+    // dead slave does not hold up the others. A slave stops getting tasks as soon as it misses a heartbeat and gets
+    // them again once it answers.
     void SendControlSignals()
     {
+        grpc::CompletionQueue heartbeatQueue;
         while (true)
         {
-            // Sending Control Intervals to Each Slave
-            for (auto &slave : Slaves)
+            vector<unique_ptr<HeartbeatCall>> calls;
             {
-                auto channel = grpc::CreateChannel(slave.second.address, grpc::InsecureChannelCredentials());
-                auto stub = SlaveService::NewStub(channel);
-                ControlSignalRequest request;
-                ControlSignalResponse response;
-                ClientContext context;
-                slave.second.SignalStatus = stub->ControlSignal(&context, request, &response);
+                lock_guard<mutex> lock(stateMutex);
+                for (auto &slave : Slaves)
+                {
+                    unique_ptr<HeartbeatCall> call(new HeartbeatCall());
+                    call->slaveID = slave.first;
+                    call->stub = slave.second.stub;
+                    call->context.set_deadline(chrono::system_clock::now() + timeoutInt);
+                    for (auto &directory : slave.second.removeDirectories)
+                        call->request.add_removedirectories(directory);
+                    call->reader = call->stub->AsyncControlSignal(&call->context, call->request, &heartbeatQueue);
+                    call->reader->Finish(&call->response, &call->status, call.get());
+                    calls.push_back(move(call));
+                }
             }
 
-            // Sleeping for timeout interval
-            this_thread::sleep_for(timeoutInt);
+            // Every heartbeat completes by its deadline at the latest
+            for (size_t i = 0; i < calls.size(); i++)
+            {
+                void *tag;
+                bool ok;
+                if (!heartbeatQueue.Next(&tag, &ok))
+                    return;
+                HandleHeartbeat(static_cast<HeartbeatCall *>(tag));
+            }
 
-            // Checking Responses of Each Slave to Mark Responsiveness
-            for (auto &slave : Slaves)
+            // Sleeping for the delay of Control Interval
+            this_thread::sleep_for(controlInt);
+        }
+    }
+
+    void HandleHeartbeat(HeartbeatCall *call)
+    {
+        lock_guard<mutex> lock(stateMutex);
+        auto slavesItr = Slaves.find(call->slaveID);
+        if (slavesItr == Slaves.end())
+            return;
+        Slave &slave = slavesItr->second;
+        slave.SignalStatus = call->status;
+        if (call->status.ok())
+        {
+            if (!slave.responsive)
             {
-                if (slave.second.SignalStatus.ok())
+                cout << "Slave: " << call->slaveID << " " << slave.address << " is responsive again" << endl;
+                WakeScheduler();
+            }
+            slave.responsive = true;
+            slave.missedHeartbeats = 0;
+            slave.load = call->response;
+            // Directories queued since the heartbeat was sent go with the next one
+            slave.removeDirectories.erase(slave.removeDirectories.begin(), slave.removeDirectories.begin() + min<size_t>(call->request.removedirectories_size(), slave.removeDirectories.size()));
+            return;
+        }
+        if (slave.responsive)
+            cout << "Slave: " << call->slaveID << " " << slave.address << " has become unresponsive: " << call->status.error_message() << endl;
+        slave.responsive = false;
+        ++slave.missedHeartbeats;
+        if (slave.missedHeartbeats == lostAfterHeartbeats)
+        {
+            cout << "Slave: " << call->slaveID << " " << slave.address << " has missed " << lostAfterHeartbeats << " heartbeats, running its tasks elsewhere" << endl;
+            LoseSlave(call->slaveID);
+        }
+        if (call->status.error_code() == grpc::StatusCode::UNAVAILABLE)
+            Connect(slave);
+    }
+
+    // Giving up on a slave that has stopped answering or has gone away. Its attempts in flight are cancelled and their
+    // tasks queued again without counting as failures. Map output it holds for jobs whose reducers are not all done
+    // yet is computed again on other slaves, ahead of other queued tasks, as reducers may be waiting for it. Its
+    // locations lose their address, so reducers started from now on do not try to fetch from the slave.
+    // Must be called with stateMutex held.
+    void LoseSlave(int slaveID)
+    {
+        string address = Slaves[slaveID].address;
+        for (auto manifestItr = manifest.begin(); manifestItr != manifest.end();)
+        {
+            if (manifestItr->second.address == address)
+                manifestItr = EvictManifestEntry(manifestItr);
+            else
+                ++manifestItr;
+        }
+        for (TaskGroup *group : runningGroups)
+        {
+            Job &job = *group->job;
+            bool reducing = job.reduceTasks.tasks.empty() || job.reduceTasks.completed < job.reduceTasks.tasks.size();
+            if (group == &job.mapTasks && reducing && !group->failed)
+            {
+                for (auto &location : job.mapLocations)
+                {
+                    if (location.address() == address)
+                        location.clear_address();
+                }
+            }
+            for (auto &task : group->tasks)
+            {
+                for (TaskCall *call : task.runningCalls)
                 {
-                    slave.second.responsive = true;
+                    if (call->slaveID == slaveID && !call->lost)
+                    {
+                        call->lost = true;
+                        call->context.TryCancel();
+                    }
                 }
-                else
+                if (task.type == MAP_TASK && task.completed && task.location.address() == address && reducing && !group->failed)
                 {
-                    slave.second.responsive = false;
-                    // cout << "Slave: " << slave.first << " " << slave.second.address << " has become unresponsive" << endl;
+                    cout << "Output of " << group->name << " Task " << task.id << " was lost with Slave: " << address << ", running it again" << endl;
+                    task.completed = false;
+                    --group->completed;
+                    pendingTasks.push_front(&task);
                 }
             }
-
-            // Sleeping for the delay of Control Interval
-            this_thread::sleep_for(controlInt);
         }
+        WakeScheduler();
     }
 
     void PrintSlaveStatus()
     {
+        lock_guard<mutex> lock(stateMutex);
         cout << "-----------------------------------------------------------------------" << endl;
         for (auto &slave : Slaves)
         {
-            cout << "Slave: " << slave.first << " with Address: " << slave.second.address << " is " << (slave.second.responsive ? "Responsive" : "UNRESPONSIVE") << endl;
+            const ControlSignalResponse &load = slave.second.load;
+            cout << "Slave: " << slave.first << " with Address: " << slave.second.address << " is " << (slave.second.responsive ? "Responsive" : "UNRESPONSIVE") << " (" << ConnectionState(slave.second) << ")";
+            if (slave.second.missedHeartbeats > 0)
+                cout << " Missed Heartbeats: " << slave.second.missedHeartbeats;
+            cout << endl;
+            cout << "    Slots: " << slave.second.slots << " Running Tasks: " << load.runningtasks() << " Free Slots: " << load.freeslots() << " CPU Load: " << int(load.cpuload() * 100) << "%"
+                 << " Memory: " << load.memoryused() / (1024 * 1024) << " MB Processed: " << load.bytesprocessed() / (1024 * 1024) << " MB" << endl;
         }
         cout << "=======================================================================" << endl;
     }
 
-    void SendMapTask(int SlaveID, string filename, string filepath, int chunkSize, int chunkNumber, vector<pair<bool, bool>> &taskCompletion)
+    // Waking the scheduler up through the CompletionQueue, so it reacts right away to new tasks and slaves.
+    // Must be called with stateMutex held.
+    void WakeScheduler()
     {
-        auto channel = grpc::CreateChannel(Slaves[SlaveID].address, grpc::InsecureChannelCredentials());
-        auto stub = SlaveService::NewStub(channel);
-        MapRequest request;
-        request.set_filepath(filepath);
-        request.set_filename(filename);
-        request.set_chunksize(chunkSize);
-        request.set_chunknumber(chunkNumber);
-        MapResponse response;
-        ClientContext context;
-        Slaves[SlaveID].TaskStatus = stub->Map(&context, request, &response);
-        Slaves[SlaveID].isFree = true;
-        if (Slaves[SlaveID].TaskStatus.ok())
+        if (wakePending)
+            return;
+        wakePending = true;
+        wakeAlarm.reset(new grpc::Alarm());
+        wakeAlarm->Set(&taskQueue, chrono::system_clock::now(), &wakeAlarm);
+    }
+
+    // Event loop of the scheduler: hands pending tasks to free slaves and handles each finished RPC as soon as the
+    // CompletionQueue delivers it, so no time is lost sleeping between checks. The wait is bounded so stragglers are
+    // looked for regularly even while no RPC finishes.
+    void Schedule()
+    {
+        void *tag;
+        bool ok;
+        while (true)
         {
-            taskCompletion[chunkNumber].first = true;
-            cout << "Map task has been completed by Slave:" << Slaves[SlaveID].address << endl;
-            PrintMapCompletion(taskCompletion);
+            {
+                lock_guard<mutex> lock(stateMutex);
+                CancelOverdueAttempts();
+                DispatchTasks();
+                SpeculateStragglers();
+            }
+            auto nextEvent = taskQueue.AsyncNext(&tag, &ok, chrono::system_clock::now() + chrono::milliseconds(500));
+            if (nextEvent == grpc::CompletionQueue::SHUTDOWN)
+                return;
+            if (nextEvent == grpc::CompletionQueue::TIMEOUT)
+                continue;
+            lock_guard<mutex> lock(stateMutex);
+            if (tag == &wakeAlarm)
+                wakePending = false;
+            else
+                CompleteTask(static_cast<TaskCall *>(tag));
+        }
+    }
+
+    bool IsAvailable(const Slave &slave)
+    {
+        return slave.responsive && slave.runningTasks < slave.slots && IsConnected(slave);
+    }
+
+    // Starting an asynchronous RPC for an attempt of a task on a slave. Must be called with stateMutex held.
+    void StartAttempt(Task *task, int slaveID)
+    {
+        Slave &slave = Slaves[slaveID];
+        ++slave.runningTasks;
+
+        TaskCall *call = new TaskCall();
+        call->task = task;
+        call->slaveID = slaveID;
+        call->attempt = task->attempts++;
+        call->started = chrono::steady_clock::now();
+        call->stub = slave.stub;
+        if (task->runningCalls.empty())
+            task->started = call->started;
+        task->runningCalls.push_back(call);
+        if (task->type == MAP_TASK)
+        {
+            MapRequest request = task->mapRequest;
+            request.set_attempt(call->attempt);
+            call->mapReader = call->stub->PrepareAsyncMap(&call->context, request, &taskQueue);
+            call->mapReader->StartCall();
+            call->mapReader->Finish(&call->mapResponse, &call->status, call);
+            cout << "Map Task with Chunk Number " << task->id << " (Attempt " << call->attempt << ") Sent to Slave: " << slave.address << endl;
         }
         else
         {
-            cout << "Map Task failed by Slave:" << Slaves[SlaveID].address << " Error:" << Slaves[SlaveID].TaskStatus.error_message() << endl;
-            taskCompletion[chunkNumber].second = false;
+            ReduceRequest request = task->reduceRequest;
+            request.set_attempt(call->attempt);
+            for (auto &location : task->group->job->mapLocations)
+                *request.add_maps() = location;
+            call->reduceReader = call->stub->PrepareAsyncReduce(&call->context, request, &taskQueue);
+            call->reduceReader->StartCall();
+            call->reduceReader->Finish(&call->reduceResponse, &call->status, call);
+            cout << "Reduce Task " << task->id << " (Attempt " << call->attempt << ") Sent to Slave: " << slave.address << " For Partition: " << task->id << endl;
         }
     }
 
-    void PrintMapCompletion(const vector<pair<bool, bool>> &taskCompletion)
+    // Ordering of slaves for new tasks: most free slots first, as counted by the master since heartbeats lag behind
+    // the tasks it has just started, then the lowest CPU load and the least memory in use of the last heartbeat
+    static bool LessLoaded(const Slave &a, const Slave &b)
     {
-        int total = taskCompletion.size();
-        int completed = 0;
-        for (int i = 0; i < total; i++)
+        if (a.slots - a.runningTasks != b.slots - b.runningTasks)
+            return a.slots - a.runningTasks > b.slots - b.runningTasks;
+        if (a.load.cpuload() != b.load.cpuload())
+            return a.load.cpuload() < b.load.cpuload();
+        return a.load.memoryused() < b.load.memoryused();
+    }
+
+    // Slaves that can take a task right now, least loaded first. Must be called with stateMutex held.
+    vector<int> AvailableSlaves()
+    {
+        vector<int> available;
+        for (auto &slave : Slaves)
         {
-            if (taskCompletion[i].first)
-                ++completed;
+            if (IsAvailable(slave.second))
+                available.push_back(slave.first);
         }
-        cout << "Map Task Completion: " << (completed * 100 / total) << "%" << endl;
+        stable_sort(available.begin(), available.end(), [this](int a, int b)
+                    { return LessLoaded(Slaves[a], Slaves[b]); });
+        return available;
     }
 
-    int AssignMapTasks()
+    // A reduce task of a job whose maps have not all completed, it holds its slot while waiting for map output
+    static bool IsEarlyReduce(const Task &task)
     {
-        hdfsFS fs = hdfsConnect("default", 9870);
-        if (fs == NULL)
+        return task.type == REDUCE_TASK && task.group->job->mapTasks.completed < task.group->job->mapTasks.tasks.size();
+    }
+
+    // Giving pending tasks to slaves with free slots, each to the least loaded slave at the time, until either runs
+    // out. Early reducers over their share of the slots are passed over and stay queued. Once slaves are lost the
+    // share shrinks, and maps run again for lost output may find every slot taken by reducers waiting for them, so
+    // early reducers over the share are preempted when a map is left waiting. Must be called with stateMutex held.
+    void DispatchTasks()
+    {
+        int totalSlots = 0;
+        for (auto &slave : Slaves)
         {
-            cout << "Error while connecting to HDFS..." << endl;
+            if (slave.second.responsive)
+                totalSlots += slave.second.slots;
         }
-        string filename = "US_AirLines.txt";
-        string filepath = "/files/";
-
-        // Getting File Info
-        hdfsFileInfo *fileInfo = hdfsGetPathInfo(fs, (filepath + filename).c_str());
-        if (!fileInfo)
+        int earlyReduces = 0;
+        for (TaskGroup *group : runningGroups)
         {
-            cout << "Failed to get file info for " << filename << endl;
-            hdfsDisconnect(fs);
+            for (auto &task : group->tasks)
+            {
+                if (!IsEarlyReduce(task))
+                    continue;
+                for (TaskCall *call : task.runningCalls)
+                {
+                    if (!call->preempted && !call->lost)
+                        ++earlyReduces;
+                }
+            }
         }
+        int maxEarlyReduces = totalSlots * earlyReduceShare;
 
-        // Getting File Size
-        tOffset fileSize = fileInfo->mSize;
-        cout << "Size of " << filename << " is " << fileSize << " bytes" << endl;
+        auto next = pendingTasks.begin();
+        while (next != pendingTasks.end())
+        {
+            bool early = IsEarlyReduce(**next);
+            if (early && earlyReduces >= maxEarlyReduces)
+            {
+                ++next;
+                continue;
+            }
+            vector<int> available = AvailableSlaves();
+            if (available.empty())
+            {
+                if (!early && earlyReduces > maxEarlyReduces)
+                    PreemptEarlyReduces(earlyReduces - maxEarlyReduces);
+                return;
+            }
+            Task *task = *next;
+            next = pendingTasks.erase(next);
+            if (early)
+                ++earlyReduces;
+            StartAttempt(task, available[0]);
+        }
+    }
 
-        hdfsFreeFileInfo(fileInfo, 1);
-        hdfsDisconnect(fs);
-        // Printing Division of Tasks
-        int divisionSize;
-        int noOfMapTasks = noOfSlaves;
-        if (noOfMapTasks > 0)
+    // Cancelling the count most recently started attempts of early reducers, which have fetched the least so far.
+    // Their tasks are queued again once the cancellation completes. Must be called with stateMutex held.
+    void PreemptEarlyReduces(int count)
+    {
+        vector<pair<Task *, TaskCall *>> attempts;
+        for (TaskGroup *group : runningGroups)
         {
-            divisionSize = fileSize / noOfMapTasks;
-            cout << "Each task is divided into " << divisionSize << " byte size. With total of " << noOfMapTasks << " Tasks. Division is bases on no of Slaves registered with Master." << endl
-                 << endl;
+            for (auto &task : group->tasks)
+            {
+                if (!IsEarlyReduce(task))
+                    continue;
+                for (TaskCall *call : task.runningCalls)
+                {
+                    if (!call->preempted && !call->lost)
+                        attempts.push_back({&task, call});
+                }
+            }
         }
-        else
+        sort(attempts.begin(), attempts.end(), [](const pair<Task *, TaskCall *> &a, const pair<Task *, TaskCall *> &b)
+             { return a.second->started > b.second->started; });
+        for (int i = 0; i < count && i < attempts.size(); i++)
         {
-            cout << "There is no Slave to Assign tasks to. Returning without completing task." << endl;
-            hdfsFreeFileInfo(fileInfo, 1);
-            hdfsDisconnect(fs);
-            return noOfMapTasks;
+            cout << attempts[i].first->group->name << " Task " << attempts[i].first->id << " is preempted on Slave: " << attempts[i].second->slaveID << " to run Map Tasks" << endl;
+            attempts[i].second->preempted = true;
+            attempts[i].second->context.TryCancel();
         }
+    }
 
-        // Initializing required variables
-        vector<pair<bool, bool>> taskCompletion(noOfMapTasks, {false, false});
+    chrono::steady_clock::duration TaskDeadline(const Task &task)
+    {
+        return taskTimeout + chrono::seconds(task.inputBytes / taskThroughput);
+    }
 
-        // Assigning Tasks to all slaves && Reassigning Unassigned
-        while (true)
+    // Cancelling attempts that have run past their deadline, their tasks are retried once the cancellation completes.
+    // Reducers of a job still mapping are waiting for map output and have no deadline until the maps are done.
+    // Must be called with stateMutex held.
+    void CancelOverdueAttempts()
+    {
+        auto now = chrono::steady_clock::now();
+        for (TaskGroup *group : runningGroups)
+        {
+            for (auto &task : group->tasks)
+            {
+                for (TaskCall *call : task.runningCalls)
+                {
+                    if (call->overdue || call->lost || call->preempted || (task.type == REDUCE_TASK && IsEarlyReduce(task)))
+                        continue;
+                    auto started = task.type == REDUCE_TASK ? max(call->started, group->job->mapsCompleted) : call->started;
+                    if (now - started <= TaskDeadline(task))
+                        continue;
+                    cout << group->name << " Task " << task.id << " (Attempt " << call->attempt << ") has run past its deadline of "
+                         << chrono::duration_cast<chrono::seconds>(TaskDeadline(task)).count() << "s on Slave: " << call->slaveID << ", cancelling it" << endl;
+                    call->overdue = true;
+                    call->context.TryCancel();
+                }
+            }
+        }
+    }
+
+    static double Median(vector<double> values)
+    {
+        sort(values.begin(), values.end());
+        return values[values.size() / 2];
+    }
+
+    // Launching a backup attempt of each straggling task on another slave with a free slot. Only slots left over
+    // after all pending tasks have been dispatched are used, and every task is speculated at most once.
+    // Must be called with stateMutex held.
+    void SpeculateStragglers()
+    {
+        if (!pendingTasks.empty())
+            return;
+        auto now = chrono::steady_clock::now();
+        for (TaskGroup *group : runningGroups)
         {
-            bool allComplete = true;
-            for (int i = 0; i < noOfMapTasks; i++)
+            if (group->durations.empty() || group->completed < group->tasks.size() * speculationStart)
+                continue;
+            double threshold = Median(group->durations) * speculationSlowdown;
+            for (auto &task : group->tasks)
             {
-                bool isaSlaveFree = false;
-                // .first if the task has not been completed & .second if the task has not been sent to a slave
-                if (!taskCompletion[i].first && !taskCompletion[i].second)
+                if (task.completed || task.runningCalls.size() != 1)
+                    continue;
+                double elapsed = chrono::duration<double>(now - task.started).count();
+                if (elapsed <= threshold)
+                    continue;
+                for (int slaveID : AvailableSlaves())
                 {
-                    for (auto &slave : Slaves)
+                    if (slaveID != task.runningCalls[0]->slaveID)
                     {
-                        if (slave.second.responsive && slave.second.isFree)
-                        {
-                            isaSlaveFree = true;
-                            // SendMapTask(slave.first, filename, filepath, divisionSize, i, taskCompletion);
-                            slave.second.isFree = false;
-                            thread thx(&Master::SendMapTask, this, slave.first, filename, filepath, divisionSize, i, ref(taskCompletion));
-                            taskCompletion[i].second = true;
-                            cout << "Map Task with Chunk Number " << i << " Sent to Slave: " << slave.second.address << endl;
-                            thx.detach();
-                            break;
-                        }
+                        cout << group->name << " Task " << task.id << " is straggling (" << elapsed << "s against a median of " << Median(group->durations) << "s), starting a speculative attempt" << endl;
+                        StartAttempt(&task, slaveID);
+                        break;
                     }
                 }
-                // If it did not found a slave to give a task wait for a second and then proceed
-                if (!isaSlaveFree)
-                    this_thread::sleep_for(chrono::seconds(1));
-                // If a task is left for completion mark allComplete to be false
-                if (!taskCompletion[i].first)
-                    allComplete = false;
-            }
-            if (allComplete)
-                break;
+            }
         }
-        cout << "All Map Tasks has been completed!" << endl;
-        return noOfMapTasks;
     }
 
-    void SendReduceTask(int SlaveID, string mapPath, string key, int numofMaps, int reduceID, vector<pair<bool, bool>> &taskCompletion)
+    // Handling a finished RPC: the slave becomes free again. The first successful attempt completes the task and
+    // cancels the others, a failed task goes back to the end of the queue unless another attempt is still running.
+    // Must be called with stateMutex held.
+    void CompleteTask(TaskCall *call)
     {
-        auto channel = grpc::CreateChannel(Slaves[SlaveID].address, grpc::InsecureChannelCredentials());
-        auto stub = SlaveService::NewStub(channel);
-        ReduceRequest request;
-        request.set_maplocation(mapPath);
-        request.set_numofmaps(numofMaps);
-        request.set_keyrange(key);
-        ReduceResponse response;
-        ClientContext context;
-        Slaves[SlaveID].TaskStatus = stub->Reduce(&context, request, &response);
-        Slaves[SlaveID].isFree = true;
-        if (Slaves[SlaveID].TaskStatus.ok())
+        Task *task = call->task;
+        TaskGroup *group = task->group;
+        task->runningCalls.erase(find(task->runningCalls.begin(), task->runningCalls.end(), call));
+        auto slavesItr = Slaves.find(call->slaveID);
+        if (slavesItr != Slaves.end())
+        {
+            slavesItr->second.TaskStatus = call->status;
+            --slavesItr->second.runningTasks;
+            if (call->status.error_code() == grpc::StatusCode::UNAVAILABLE)
+                Connect(slavesItr->second);
+        }
+        if (task->completed || group->failed)
+        {
+            // A duplicate attempt of a task another attempt has already completed, or an attempt of a failed job
+        }
+        else if (call->status.ok())
         {
-            taskCompletion[reduceID].first = true;
-            cout << "Reduce task has been completed by Slave:" << Slaves[SlaveID].address << endl;
-            PrintReduceCompletion(taskCompletion);
+            task->completed = true;
+            if (task->type == MAP_TASK)
+            {
+                task->location.set_address(call->mapResponse.address());
+                task->location.set_chunknumber(task->id);
+                task->location.set_directory(group->job->workDirectory);
+                task->location.set_split(task->id);
+                group->job->mapLocations.push_back(task->location);
+                const MapRequest &request = task->mapRequest;
+                SplitKey key(SegmentsKey(request), request.numofpartitions(), PartitioningHash(request));
+                auto manifestItr = manifest.find(key);
+                if (manifestItr != manifest.end())
+                    EvictManifestEntry(manifestItr);
+                manifest[key] = {task->fingerprint, task->versions, task->location.address(), group->job->workDirectory, task->id};
+                mapCompleted.notify_all();
+            }
+            else
+                task->topWords.assign(call->reduceResponse.topwords().begin(), call->reduceResponse.topwords().end());
+            for (TaskCall *duplicate : task->runningCalls)
+                duplicate->context.TryCancel();
+            task->duration = chrono::duration<double>(chrono::steady_clock::now() - call->started).count();
+            group->durations.push_back(task->duration);
+            ++group->completed;
+            cout << group->name << " task has been completed by Slave:" << call->slaveID << " (Attempt " << call->attempt << ")" << endl;
+            cout << group->name << " Task Completion: " << (group->completed * 100 / group->tasks.size()) << "%" << endl;
+            if (task->type == MAP_TASK && group->completed == group->tasks.size())
+                group->job->mapsCompleted = chrono::steady_clock::now();
         }
         else
         {
-            cout << "Reduce Task failed by Slave:" << Slaves[SlaveID].address << " Error:" << Slaves[SlaveID].TaskStatus.error_message() << endl;
-            taskCompletion[reduceID].second = false;
+            string reason = call->lost ? "Slave lost" : (call->preempted ? "Preempted" : (call->overdue ? "Deadline exceeded" : call->status.error_message()));
+            if (!call->lost && !call->preempted)
+                ++task->failures;
+            cout << group->name << " Task " << task->id << " failed by Slave:" << call->slaveID << " Error:" << reason << " (" << task->failures << " of " << maxTaskFailures << " failures)" << endl;
+            if (task->failures >= maxTaskFailures)
+                FailJob(*group->job, group->name + " Task " + to_string(task->id) + " failed " + to_string(task->failures) + " times, last error: " + reason);
+            else if (task->runningCalls.empty())
+                pendingTasks.push_back(task);
         }
+        if (!task->runningCalls.empty())
+            task->started = task->runningCalls[0]->started;
+        // Waiters also look at the attempts still in flight, so every finished attempt is worth a look
+        group->progress.notify_all();
+        delete call;
     }
 
-    void PrintReduceCompletion(const vector<pair<bool, bool>> &taskCompletion)
+    // Giving up on a job a task of which has failed too often: its queued tasks are dropped and its attempts in flight
+    // cancelled. Must be called with stateMutex held.
+    void FailJob(Job &job, const string &error)
     {
-        int total = taskCompletion.size();
-        int completed = 0;
-        for (int i = 0; i < total; i++)
+        if (job.mapTasks.failed)
+            return;
+        cout << "Job " << job.id << " has failed: " << error << endl;
+        job.error = error;
+        for (TaskGroup *group : {&job.mapTasks, &job.reduceTasks})
         {
-            if (taskCompletion[i].first)
-                ++completed;
+            group->failed = true;
+            for (auto &task : group->tasks)
+            {
+                for (TaskCall *call : task.runningCalls)
+                    call->context.TryCancel();
+            }
+            group->progress.notify_all();
         }
-        cout << "Reduce Task Completion: " << (completed * 100 / total) << "%" << endl;
+        pendingTasks.erase(remove_if(pendingTasks.begin(), pendingTasks.end(), [&job](Task *task)
+                                     { return task->group->job == &job; }),
+                           pendingTasks.end());
     }
 
-    string AssignReduceTasks(int numOfMaps)
+    // Queuing all tasks of a group for the scheduler. Reduce tasks go ahead of the queued map tasks so they can start
+    // fetching while the maps run, DispatchTasks keeps them to their share of the slots.
+    void StartTasks(TaskGroup &group, vector<Task> tasks)
     {
-        string maplocation = "/files/";
-        string key;
-        for (int i = 97; i <= 122; i++)
-            key += char(i);
-        vector<string> keyranges;
-        int letters = key.size();
-        int divisionSize = letters / numOfMaps;
-        bool unequalDivision = letters % numOfMaps;
-        // dividing key into a vector of key ranges
-        for (int i = 0; i < letters; i += divisionSize)
-        {
-            if (i + divisionSize < letters || !unequalDivision)
-                keyranges.push_back(key.substr(i, divisionSize));
-            else
-                keyranges[keyranges.size() - 1] += key.substr(i, divisionSize);
+        lock_guard<mutex> lock(stateMutex);
+        group.tasks = move(tasks);
+        group.completed = 0;
+        vector<Task *> queued;
+        for (auto &task : group.tasks)
+        {
+            task.group = &group;
+            if (!task.completed)
+            {
+                queued.push_back(&task);
+                continue;
+            }
+            // Map output reused from an earlier job
+            ++group.completed;
+            group.job->mapLocations.push_back(task.location);
         }
+        if (group.completed == group.tasks.size())
+            group.job->mapsCompleted = chrono::steady_clock::now();
+        if (!queued.empty() && queued[0]->type == REDUCE_TASK)
+            pendingTasks.insert(pendingTasks.begin(), queued.begin(), queued.end());
+        else
+            pendingTasks.insert(pendingTasks.end(), queued.begin(), queued.end());
+        runningGroups.push_back(&group);
+        WakeScheduler();
+    }
 
-        // Output files are named as output-(the first key from keyrange).txt So getting these first key letter for use in Sorting
-        string keysForSorting;
-        for (int i = 0; i < keyranges.size(); i++)
+    // Blocking until every task of a group started with StartTasks has completed, false if the job has failed instead
+    bool WaitForTasks(TaskGroup &group)
+    {
+        unique_lock<mutex> lock(stateMutex);
+        // Duplicate attempts that were cancelled may still be in flight, the group lives on until they have finished
+        group.progress.wait(lock, [&group]()
+                                {
+                                    if (group.completed != group.tasks.size() && !group.failed)
+                                        return false;
+                                    for (auto &task : group.tasks)
+                                    {
+                                        if (!task.runningCalls.empty())
+                                            return false;
+                                    }
+                                    return true; });
+        return !group.failed;
+    }
+
+    // Taking the tasks of a finished job off the scheduler. Maps run again for output lost after the reducers had
+    // finished are no longer needed, they are dropped or cancelled and waited for.
+    void RetireTasks(Job &job)
+    {
+        unique_lock<mutex> lock(stateMutex);
+        pendingTasks.erase(remove_if(pendingTasks.begin(), pendingTasks.end(), [&job](Task *task)
+                                     { return task->group->job == &job; }),
+                           pendingTasks.end());
+        for (TaskGroup *group : {&job.mapTasks, &job.reduceTasks})
         {
-            keysForSorting += keyranges[i].at(0);
+            group->failed = true; // Keeps lost map output from being queued again
+            for (auto &task : group->tasks)
+            {
+                for (TaskCall *call : task.runningCalls)
+                    call->context.TryCancel();
+            }
+            group->progress.wait(lock, [group]()
+                                 { return all_of(group->tasks.begin(), group->tasks.end(), [](const Task &task)
+                                                 { return task.runningCalls.empty(); }); });
+            auto groupItr = find(runningGroups.begin(), runningGroups.end(), group);
+            if (groupItr != runningGroups.end())
+                runningGroups.erase(groupItr);
         }
+    }
 
-        // Initializing required variables
-        vector<pair<bool, bool>> taskCompletion(numOfMaps, {false, false});
+    // Recording the duration of the phase and of each of its tasks
+    static void AddToStats(const TaskGroup &group, chrono::steady_clock::time_point started, double &phaseSeconds, JobStats &stats)
+    {
+        phaseSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        for (auto &task : group.tasks)
+            stats.taskSeconds[{task.type == MAP_TASK ? "Map" : "Reduce", task.id}] = task.duration;
+    }
 
-        // Assigning Tasks to all slaves && Reassigning Unassigned
-        while (true)
+    static bool IsHidden(const string &name)
+    {
+        return name.empty() || name[0] == '.' || name[0] == '_';
+    }
+
+    // Adding the files an input names to files: the file itself, the files of a directory, or the files matching a
+    // glob pattern, which may use *, ? and [...] in any component. Names starting with '.' or '_' are left out of
+    // directories and patterns, as they mark hidden and temporary files. Returns false and the reason in error if the
+    // input names no file.
+    bool ExpandInput(const string &input, vector<FileInfo> &files, string &error)
+    {
+        // Matching one component at a time, so only the directories the components before it lead to are listed
+        vector<string> matches = {""};
+        for (size_t start = 0, end; start < input.size(); start = end + 1)
         {
-            bool allComplete = true;
-            for (int i = 0; i < keyranges.size(); i++)
+            end = min(input.find('/', start), input.size());
+            string component = input.substr(start, end - start);
+            if (component.empty())
+                continue;
+            vector<string> next;
+            for (auto &prefix : matches)
             {
-                bool isaSlaveFree = false;
-                // .first if the task has not been completed & .second if the task has not been sent to a slave
-                if (!taskCompletion[i].first && !taskCompletion[i].second)
+                if (component.find_first_of("*?[") == string::npos)
                 {
-                    for (auto &slave : Slaves)
-                    {
-                        if (slave.second.responsive && slave.second.isFree)
-                        {
-                            isaSlaveFree = true;
-                            slave.second.isFree = false;
-                            thread thx(&Master::SendReduceTask, this, slave.first, maplocation, keyranges[i], numOfMaps, i, ref(taskCompletion));
-                            taskCompletion[i].second = true;
-                            cout << "Reduce Task " << i << " Sent to Slave: " << slave.second.address << " With Keys: " << keyranges[i] << endl;
-                            thx.detach();
-                            break;
-                        }
-                    }
+                    next.push_back(prefix + "/" + component);
+                    continue;
                 }
-                // If it did not found a slave to give a task wait for a second and then proceed
-                if (!isaSlaveFree)
-                    this_thread::sleep_for(chrono::seconds(1));
-                // If a task is left for completion mark allComplete to be false
-                if (!taskCompletion[i].first)
-                    allComplete = false;
-            }
-            if (allComplete)
-                break;
+                vector<FileInfo> entries;
+                if (!storage->ListDirectory(prefix.empty() ? "/" : prefix, entries))
+                    continue;
+                for (auto &entry : entries)
+                {
+                    string name = entry.path.substr(entry.path.rfind('/') + 1);
+                    if (!IsHidden(name) && fnmatch(component.c_str(), name.c_str(), 0) == 0)
+                        next.push_back(prefix + "/" + name);
+                }
+            }
+            matches = move(next);
+        }
+
+        size_t found = files.size();
+        for (auto &path : matches)
+        {
+            FileInfo info;
+            if (!storage->GetFileInfo(path, info))
+                continue;
+            if (!info.isDirectory)
+            {
+                files.push_back(info);
+                continue;
+            }
+            vector<FileInfo> entries;
+            if (!storage->ListDirectory(path, entries))
+                continue;
+            for (auto &entry : entries)
+            {
+                if (!entry.isDirectory && !IsHidden(entry.path.substr(entry.path.rfind('/') + 1)))
+                    files.push_back(entry);
+            }
+        }
+        if (files.size() == found)
+        {
+            cout << "No input files found for " << input << endl;
+            error = "No input files found for " + input;
+            return false;
         }
-        cout << "All Reduce Tasks has been completed!" << endl;
-        return keysForSorting;
+        return true;
     }
 
-    int getline(string &line, char *buffer, const int bytesRead, const int bufferRead, bool &isFullLine)
+    // Creating the map tasks of a job over all of its input files. Returns false and the reason in error if an input
+    // names no file.
+    bool CreateMapTasks(Job &job, int numOfReducers, vector<Task> &tasks, string &error)
     {
-        int read = 0;
-        isFullLine = false;
-        for (int i = bufferRead; i < bytesRead; i++)
+        // Every file is counted once, in path order, so the same input is divided into the same splits on every run
+        vector<FileInfo> files;
+        for (auto &input : job.request.inputpaths())
         {
-            if (buffer[i] == '\n')
+            if (!ExpandInput(input, files, error))
+                return false;
+        }
+        sort(files.begin(), files.end(), [](const FileInfo &a, const FileInfo &b)
+             { return a.path < b.path; });
+        files.erase(unique(files.begin(), files.end(), [](const FileInfo &a, const FileInfo &b)
+                           { return a.path == b.path; }),
+                    files.end());
+
+        // Dividing large files into splits aligned to the storage block size (or the configured split size), so the
+        // number of map tasks follows the input size rather than the number of files or slaves. Files smaller than a
+        // split are packed together into splits of up to that size instead of getting a task each.
+        vector<vector<Segment>> splits;
+        vector<Segment> packed;
+        int64_t packedSize = 0;
+        int64_t totalSize = 0;
+        for (auto &file : files)
+        {
+            int64_t divisionSize = job.splitSize > 0 ? job.splitSize : (file.blockSize > 0 ? file.blockSize : defaultSplitSize);
+            totalSize += file.size;
+            if (file.size >= divisionSize)
+            {
+                for (int64_t offset = 0; offset < file.size; offset += divisionSize)
+                    splits.push_back({MakeSegment(file.path, offset, min(divisionSize, file.size - offset))});
+                continue;
+            }
+            if (file.size == 0)
+                continue;
+            if (!packed.empty() && packedSize + file.size > divisionSize)
+            {
+                splits.push_back(move(packed));
+                packed.clear();
+                packedSize = 0;
+            }
+            packed.push_back(MakeSegment(file.path, 0, file.size));
+            packedSize += file.size;
+        }
+        if (!packed.empty())
+            splits.push_back(move(packed));
+        cout << "Job " << job.id << " reads " << files.size() << " files of " << totalSize << " bytes in " << splits.size() << " Splits" << endl;
+        vector<string> splitPoints;
+        if (job.request.ordered())
+        {
+            // Without split points the output would be hash partitioned and not ordered as a whole, which is only
+            // right if the input has no words at all
+            if (!SampleSplitPoints(splits, numOfReducers, job.delimiters, splitPoints))
+            {
+                error = "Failed to read the input of ordered Job " + to_string(job.id) + " to sample its Split Points";
+                return false;
+            }
+            cout << "Job " << job.id << " is range partitioned on " << splitPoints.size() << " Split Points sampled from its input" << endl;
+        }
+
+        map<string, FileVersion> versions;
+        for (auto &file : files)
+            versions[file.path] = {file.size, file.modificationTime};
+
+        // Splits are numbered together, their map output is named after that number
+        string openPath;
+        unique_ptr<InputFile> input_file;
+        for (int splitNumber = 0; splitNumber < splits.size(); splitNumber++)
+        {
+            uint64_t fingerprint = Fnv("");
+            bool fingerprinted = true;
+            for (auto &segment : splits[splitNumber])
+            {
+                if (segment.path() != openPath)
+                {
+                    openPath = segment.path();
+                    input_file = storage->OpenInput(openPath);
+                }
+                fingerprinted = fingerprinted && input_file && SplitFingerprint(*input_file, segment.offset(), segment.length(), fingerprint);
+            }
+            Task task;
+            task.type = MAP_TASK;
+            task.id = splitNumber;
+            task.fingerprint = fingerprinted ? fingerprint : 0;
+            for (auto &segment : splits[splitNumber])
+            {
+                *task.mapRequest.add_segments() = segment;
+                task.versions.push_back(versions[segment.path()]);
+            }
+            task.mapRequest.set_delimiters(job.delimiters);
+            for (auto &splitPoint : splitPoints)
+                task.mapRequest.add_splitpoints(splitPoint);
+            task.mapRequest.set_chunknumber(task.id);
+            task.mapRequest.set_combinerbudget(combinerBudget);
+            task.mapRequest.set_numofpartitions(numOfReducers);
+            task.mapRequest.set_codec(intermediateCodec);
+            task.mapRequest.set_readbuffersize(readBufferSize);
+            task.mapRequest.set_workdirectory(job.workDirectory);
+            task.mapRequest.set_jobid(job.id);
+            for (auto &segment : splits[splitNumber])
+                task.inputBytes += segment.length();
+            // A split whose output is reused starts out completed, it is only mapped if the slave holding it is lost
+            task.completed = fingerprinted && ReuseMapOutput(job, SplitKey(SegmentsKey(task.mapRequest), numOfReducers, PartitioningHash(task.mapRequest)), fingerprint, task);
+            tasks.push_back(task);
+        }
+        cout << "Job " << job.id << " is divided into " << tasks.size() - job.cachedSplits << " Map Tasks, reusing the Map Output of "
+             << job.cachedSplits << " unchanged Splits." << endl
+             << endl;
+        return true;
+    }
+
+    // Choosing the split points of an ordered job from words sampled across its input, sampleReads windows spread
+    // evenly over the bytes of all splits. A reducer's work follows the number of distinct words it is given, as every
+    // map sends it each of its words once after combining, so the points are quantiles of the distinct words sampled
+    // rather than of all their occurrences and a frequent word costs its reducer no more than a rare one. False if no
+    // words could be sampled because the input could not be read.
+    bool SampleSplitPoints(const vector<vector<Segment>> &splits, int numOfPartitions, const string &delimiters, vector<string> &splitPoints)
+    {
+        vector<Segment> segments;
+        int64_t totalSize = 0;
+        for (auto &split : splits)
+        {
+            for (auto &segment : split)
+            {
+                segments.push_back(segment);
+                totalSize += segment.length();
+            }
+        }
+
+        DelimiterSet delimiterSet(DelimiterSet::whitespace + delimiters);
+        set<string> words;
+        string window;
+        string openPath;
+        unique_ptr<InputFile> input_file;
+        size_t index = 0;
+        int64_t segmentStart = 0; // Of segments[index], counting the bytes of all segments laid end to end
+        bool failedReads = false;
+        for (int i = 0; i < sampleReads && totalSize > 0; i++)
+        {
+            int64_t target = totalSize * i / sampleReads;
+            while (segmentStart + segments[index].length() <= target)
+                segmentStart += segments[index++].length();
+            const Segment &segment = segments[index];
+            if (segment.path() != openPath)
+            {
+                openPath = segment.path();
+                input_file = storage->OpenInput(openPath);
+            }
+            int64_t start = segment.offset() + target - segmentStart;
+            window.resize(min(sampleWindow, segment.offset() + segment.length() - start));
+            int64_t length = input_file ? input_file->Read(start, &window[0], window.size()) : -1;
+            if (length <= 0)
+            {
+                failedReads = true;
+                continue;
+            }
+            // Words cut by the edges of the window are left out
+            int64_t position = start > 0 ? delimiterSet.FindDelimiter(window.data(), length) : 0;
+            while (true)
             {
-                isFullLine = true;
-                return read;
+                position += delimiterSet.FindNonDelimiter(window.data() + position, length - position);
+                if (position == length)
+                    break;
+                int64_t wordEnd = position + delimiterSet.FindDelimiter(window.data() + position, length - position);
+                if (wordEnd == length && start + length < input_file->Size())
+                    break;
+                words.emplace(window.data() + position, wordEnd - position);
+                position = wordEnd;
             }
+        }
+
+        vector<string> sorted(words.begin(), words.end());
+        splitPoints.clear();
+        for (int i = 1; i < numOfPartitions && !sorted.empty(); i++)
+            splitPoints.push_back(sorted[sorted.size() * i / numOfPartitions]);
+        // A few failed reads only make the sample smaller, but with no words sampled at all there are no split points
+        return !(sorted.empty() && failedReads && numOfPartitions > 1);
+    }
+
+    // Hash of what decides the partition a word is written to besides the number of partitions: the delimiters and
+    // the split points of an ordered job
+    static uint64_t PartitioningHash(const MapRequest &request)
+    {
+        uint64_t hash = Fnv(request.delimiters());
+        for (auto &splitPoint : request.splitpoints())
+            hash = Fnv("\n" + splitPoint, hash);
+        return hash;
+    }
+
+    static Segment MakeSegment(const string &path, int64_t offset, int64_t length)
+    {
+        Segment segment;
+        segment.set_path(path);
+        segment.set_offset(offset);
+        segment.set_length(length);
+        return segment;
+    }
+
+    static string SegmentsKey(const MapRequest &request)
+    {
+        string key;
+        for (auto &segment : request.segments())
+            key += (key.empty() ? "" : "\t") + to_string(segment.offset()) + "\t" + to_string(segment.length()) + "\t" + segment.path();
+        return key;
+    }
+
+    static uint64_t Fnv(string_view data, uint64_t hash = 14695981039346656037ULL)
+    {
+        for (unsigned char c : data)
+        {
+            hash ^= c;
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    // Hash of samples of the bytes a split's map output depends on at its edges: the byte before it, which tells
+    // whether its first word is cut, the beginning and end of the split, and the bytes after it its last word may run
+    // into. Segments of a split are hashed one after the other into the same fingerprint. Changes between the edges
+    // are caught by the versions of the files, see ReusableVersions.
+    bool SplitFingerprint(InputFile &input_file, int64_t offset, int64_t length, uint64_t &fingerprint)
+    {
+        int64_t fileSize = input_file.Size();
+        fingerprint = Fnv(to_string(length), fingerprint);
+        int64_t ranges[3][2] = {{max<int64_t>(0, offset - 1), offset + min(length, fingerprintSample)},
+                                {offset + max<int64_t>(0, length - fingerprintSample), offset + length},
+                                {offset + length, min(fileSize, offset + length + fingerprintSample)}};
+        string sample;
+        for (auto &range : ranges)
+        {
+            sample.resize(range[1] - range[0]);
+            if (!sample.empty() && input_file.Read(range[0], &sample[0], sample.size()) != sample.size())
+                return false;
+            fingerprint = Fnv(sample, fingerprint);
+        }
+        return true;
+    }
+
+    // Whether the files of a split at their current versions still hold what they held when the split was mapped. A
+    // file of the same size and modification time has not changed. One that has grown since is taken for appended to,
+    // like a log, so a split lying wholly below its old end is unchanged and only the splits over the new bytes and the
+    // one its last word may have run on into are mapped again. A file changed in any other way is mapped again as a
+    // whole. The fingerprint of the split catches appends that also changed the bytes at its edges.
+    static bool ReusableVersions(const MapRequest &request, const vector<FileVersion> &mapped, const vector<FileVersion> &current)
+    {
+        if (mapped.size() != request.segments_size() || current.size() != mapped.size())
+            return false;
+        for (int i = 0; i < request.segments_size(); i++)
+        {
+            const Segment &segment = request.segments(i);
+            if (current[i].size == mapped[i].size && current[i].modificationTime == mapped[i].modificationTime)
+                continue;
+            if (current[i].size > mapped[i].size && segment.offset() + segment.length() <= mapped[i].size)
+                continue;
+            return false;
+        }
+        return true;
+    }
+
+    // Handing the job the map output of a split from an earlier job if the split has not changed since and the slave
+    // holding the output is answering heartbeats. The entry takes on the current versions of the files, so an append
+    // is only accepted against the size the files had when the output was last used.
+    bool ReuseMapOutput(Job &job, const SplitKey &key, uint64_t fingerprint, Task &task)
+    {
+        lock_guard<mutex> lock(stateMutex);
+        auto manifestItr = manifest.find(key);
+        if (manifestItr == manifest.end() || manifestItr->second.fingerprint != fingerprint ||
+            !ReusableVersions(task.mapRequest, manifestItr->second.versions, task.versions))
+            return false;
+        ManifestEntry &entry = manifestItr->second;
+        bool held = any_of(Slaves.begin(), Slaves.end(), [&entry](const pair<const int, Slave> &slave)
+                           { return slave.second.address == entry.address && slave.second.responsive; });
+        if (!held)
+        {
+            // The split is mapped again by this job, which supersedes the entry anyway
+            EvictManifestEntry(manifestItr);
+            return false;
+        }
+        entry.versions = task.versions;
+        job.reusedDirectories.insert(entry.directory);
+        task.location.set_address(entry.address);
+        task.location.set_chunknumber(entry.chunkNumber);
+        task.location.set_directory(entry.directory);
+        task.location.set_split(task.id);
+        ++job.cachedSplits;
+        return true;
+    }
+
+    // Dropping a manifest entry whose map output is lost or superseded. Must be called with stateMutex held.
+    map<SplitKey, ManifestEntry>::iterator EvictManifestEntry(map<SplitKey, ManifestEntry>::iterator manifestItr)
+    {
+        string directory = manifestItr->second.directory;
+        manifestItr = manifest.erase(manifestItr);
+        ReleaseDirectory(directory);
+        return manifestItr;
+    }
+
+    // Queuing a job work directory for removal from the local disk of every slave unless the manifest or a job that
+    // has not finished still refers to it. Must be called with stateMutex held.
+    void ReleaseDirectory(const string &directory)
+    {
+        for (auto &split : manifest)
+        {
+            if (split.second.directory == directory)
+                return;
+        }
+        for (auto &job : jobs)
+        {
+            if (job.second->state == masterslave::JOB_SUCCEEDED || job.second->state == masterslave::JOB_FAILED)
+                continue;
+            if (job.second->workDirectory == directory || job.second->reusedDirectories.count(directory))
+                return;
+        }
+        cout << "Removing " << directory << " from the Slaves, none of its Map Output is needed any more" << endl;
+        for (auto &slave : Slaves)
+            slave.second.removeDirectories.push_back(directory);
+    }
+
+    // Dropping the entries a successful job has superseded: entries over the files it read and partitioned the same
+    // way, but for splits the job no longer has, as when a file has grown and is divided differently. Must be called
+    // with stateMutex held.
+    void EvictSupersededEntries(const Job &job)
+    {
+        set<SplitKey> keys;
+        set<pair<int64_t, uint64_t>> partitionings;
+        set<string> paths;
+        for (auto &task : job.mapTasks.tasks)
+        {
+            const MapRequest &request = task.mapRequest;
+            keys.insert(SplitKey(SegmentsKey(request), request.numofpartitions(), PartitioningHash(request)));
+            partitionings.insert({request.numofpartitions(), PartitioningHash(request)});
+            for (auto &segment : request.segments())
+                paths.insert(segment.path());
+        }
+        for (auto manifestItr = manifest.begin(); manifestItr != manifest.end();)
+        {
+            const SplitKey &key = manifestItr->first;
+            bool superseded = !keys.count(key) && partitionings.count({get<1>(key), get<2>(key)});
+            if (superseded)
+            {
+                // Every third field of the segments is a path
+                istringstream fields(get<0>(key));
+                string field;
+                superseded = false;
+                for (int i = 0; getline(fields, field, '\t') && !superseded; i++)
+                    superseded = i % 3 == 2 && paths.count(field);
+            }
+            if (superseded)
+                manifestItr = EvictManifestEntry(manifestItr);
             else
+                ++manifestItr;
+        }
+    }
+
+    // Manifest file, one split per line of tab separated fields: fingerprint, number of partitions, delimiters hash,
+    // chunk number, address, directory, file versions as size:modification time separated by commas and, as the rest
+    // of the line, the segments. Lines that do not parse, as those of older manifests without versions, are dropped. Job ids continue after the jobs the
+    // manifest refers to, so new jobs never write into a work directory holding map output still in use.
+    void LoadManifest()
+    {
+        unique_ptr<InputFile> input_file = storage->OpenInput(manifestPath);
+        if (!input_file)
+            return;
+        string contents(input_file->Size(), '\0');
+        if (input_file->Read(0, &contents[0], contents.size()) != contents.size())
+        {
+            cout << "Failed to read the manifest " << manifestPath << endl;
+            return;
+        }
+        istringstream lines(contents);
+        string line;
+        while (getline(lines, line))
+        {
+            istringstream fields(line);
+            ManifestEntry entry;
+            int64_t numOfPartitions;
+            uint64_t delimitersHash;
+            string versions, segments;
+            if (!(fields >> entry.fingerprint >> numOfPartitions >> delimitersHash >> entry.chunkNumber) || fields.get() != '\t' ||
+                !getline(fields, entry.address, '\t') || !getline(fields, entry.directory, '\t') || !getline(fields, versions, '\t') ||
+                !ParseVersions(versions, entry.versions) || !getline(fields, segments) || segments.empty())
+                continue;
+            manifest[SplitKey(segments, numOfPartitions, delimitersHash)] = entry;
+            long long jobID;
+            if (sscanf(entry.directory.c_str(), "/jobs/job-%lld/", &jobID) == 1)
+                nextJobID = max<int64_t>(nextJobID, jobID + 1);
+        }
+        cout << "Loaded " << manifest.size() << " Splits from the manifest " << manifestPath << endl;
+    }
+
+    // Parsing the file versions field of a manifest line, false if it is malformed
+    static bool ParseVersions(const string &field, vector<FileVersion> &versions)
+    {
+        istringstream items(field);
+        string item;
+        while (getline(items, item, ','))
+        {
+            FileVersion version;
+            char separator;
+            istringstream parts(item);
+            if (!(parts >> version.size >> separator >> version.modificationTime) || separator != ':' || parts.get() != EOF)
+                return false;
+            versions.push_back(version);
+        }
+        return !versions.empty();
+    }
+
+    // Rewriting the manifest file under a temporary name and renaming it over the old one
+    void SaveManifest()
+    {
+        lock_guard<mutex> manifestLock(manifestMutex);
+        string contents;
+        {
+            lock_guard<mutex> lock(stateMutex);
+            for (auto &split : manifest)
+            {
+                const ManifestEntry &entry = split.second;
+                string versions;
+                for (auto &version : entry.versions)
+                    versions += (versions.empty() ? "" : ",") + to_string(version.size) + ":" + to_string(version.modificationTime);
+                contents += to_string(entry.fingerprint) + "\t" + to_string(get<1>(split.first)) + "\t" + to_string(get<2>(split.first)) + "\t" +
+                            to_string(entry.chunkNumber) + "\t" + entry.address + "\t" + entry.directory + "\t" + versions + "\t" + get<0>(split.first) + "\n";
+            }
+        }
+        string temporaryPath = manifestPath + ".tmp";
+        unique_ptr<OutputFile> output_file = storage->OpenOutput(temporaryPath);
+        if (!output_file || !output_file->Write(contents.data(), contents.size()) || !output_file->Close() || !storage->Rename(temporaryPath, manifestPath))
+            cout << "Failed to write the manifest " << manifestPath << endl;
+    }
+
+    // Each reducer is given one hash partition of the map output, fetches it from the slaves that ran the maps and
+    // writes it to output-(partition).txt in the output directory of the job. Each attempt is sent the maps completed by
+    // the time it starts, the reducer asks WaitForMaps for the rest.
+    vector<Task> CreateReduceTasks(Job &job, int numOfReducers)
+    {
+        lock_guard<mutex> lock(stateMutex);
+        int64_t inputBytes = 0;
+        for (auto &task : job.mapTasks.tasks)
+            inputBytes += task.inputBytes;
+        vector<Task> tasks;
+        for (int i = 0; i < numOfReducers; i++)
+        {
+            Task task;
+            task.type = REDUCE_TASK;
+            task.id = i;
+            task.inputBytes = inputBytes / numOfReducers;
+            task.reduceRequest.set_maplocation(job.workDirectory);
+            task.reduceRequest.set_outputdirectory(job.request.outputdirectory());
+            task.reduceRequest.set_numofmaps(job.mapTasks.tasks.size());
+            task.reduceRequest.set_partition(i);
+            task.reduceRequest.set_numofpartitions(numOfReducers);
+            task.reduceRequest.set_topk(job.request.topk());
+            task.reduceRequest.set_memorybudget(reduceBudget);
+            task.reduceRequest.set_readbuffersize(readBufferSize);
+            task.reduceRequest.set_jobid(job.id);
+            tasks.push_back(task);
+        }
+        return tasks;
+    }
+
+    // Merging the top K lists of all partitions with a heap holding the head of every list. Every word belongs to exactly
+    // one partition, so the K most frequent words overall are the first K of the merged lists.
+    static vector<WordCount> MergeTopKWords(const vector<vector<WordCount>> &topWords, int k)
+    {
+        // (list, position in list) of the head of every list, the most frequent word on top of the heap
+        auto lessFrequent = [&topWords](const pair<int, int> &a, const pair<int, int> &b)
+        {
+            const WordCount &first = topWords[a.first][a.second];
+            const WordCount &second = topWords[b.first][b.second];
+            return first.count() != second.count() ? first.count() < second.count() : first.word() > second.word();
+        };
+        priority_queue<pair<int, int>, vector<pair<int, int>>, decltype(lessFrequent)> heads(lessFrequent);
+        for (int i = 0; i < topWords.size(); i++)
+        {
+            if (!topWords[i].empty())
+                heads.push({i, 0});
+        }
+
+        vector<WordCount> merged;
+        for (int i = 0; i < k && !heads.empty(); i++)
+        {
+            pair<int, int> head = heads.top();
+            heads.pop();
+            merged.push_back(topWords[head.first][head.second]);
+            if (head.second + 1 < topWords[head.first].size())
+                heads.push({head.first, head.second + 1});
+        }
+        return merged;
+    }
+
+    void SetJobState(Job &job, JobState state, const string &error = "")
+    {
+        lock_guard<mutex> lock(stateMutex);
+        job.state = state;
+        job.error = error;
+        if (state == masterslave::JOB_SUCCEEDED || state == masterslave::JOB_FAILED)
+        {
+            ReleaseDirectory(job.workDirectory);
+            for (auto &directory : job.reusedDirectories)
+                ReleaseDirectory(directory);
+            finishedJobs.push_back(job.id);
+            if (finishedJobs.size() > maxFinishedJobs)
+            {
+                jobs.erase(finishedJobs.front());
+                finishedJobs.pop_front();
+            }
+            jobFinished.notify_all();
+        }
+    }
+
+    // A task of the job has failed maxTaskFailures times. The map output completed so far stays in the manifest, so
+    // submitting the job again only maps what is missing.
+    void FinishFailedJob(Job &job)
+    {
+        RetireTasks(job);
+        SaveManifest();
+        string error;
+        {
+            lock_guard<mutex> lock(stateMutex);
+            error = job.error;
+        }
+        SetJobState(job, masterslave::JOB_FAILED, error);
+    }
+
+    // Running the map and reduce phases of a job. Jobs run by different threads share the scheduler, so the tasks of
+    // one job fill the slots another job leaves idle.
+    void RunJob(Job &job)
+    {
+        int numOfReducers = job.request.numofreducers();
+        {
+            lock_guard<mutex> lock(stateMutex);
+            // One reducer per registered slave unless the job asks for a number, the map output is hash partitioned between them
+            if (numOfReducers <= 0)
+                numOfReducers = noOfSlaves;
+        }
+        if (numOfReducers == 0)
+        {
+            cout << "There is no Slave to Assign tasks to. Returning without completing Job " << job.id << "." << endl;
+            SetJobState(job, masterslave::JOB_FAILED, "There is no Slave to assign tasks to");
+            return;
+        }
+
+        cout << "Starting Job " << job.id << " in " << job.workDirectory << endl;
+        SetJobState(job, masterslave::JOB_MAPPING);
+        vector<Task> mapTasks;
+        string error;
+        if (!CreateMapTasks(job, numOfReducers, mapTasks, error))
+        {
+            SetJobState(job, masterslave::JOB_FAILED, error);
+            return;
+        }
+        // Free slots are given the next split from the scheduler's queue, failed splits are put back at its end
+        auto mapStarted = chrono::steady_clock::now();
+        StartTasks(job.mapTasks, move(mapTasks));
+
+        // Reducers are started once reduceSlowstart of the maps have completed rather than after the last one, so the
+        // shuffle overlaps the rest of the map phase
+        bool mapsFailed;
+        {
+            unique_lock<mutex> lock(stateMutex);
+            job.mapTasks.progress.wait(lock, [this, &job]()
+                                       { return job.mapTasks.completed >= job.mapTasks.tasks.size() * reduceSlowstart || job.mapTasks.failed; });
+            mapsFailed = job.mapTasks.failed;
+        }
+        auto reduceStarted = chrono::steady_clock::now();
+        if (!mapsFailed)
+            StartTasks(job.reduceTasks, CreateReduceTasks(job, numOfReducers));
+
+        if (!WaitForTasks(job.mapTasks))
+        {
+            FinishFailedJob(job);
+            return;
+        }
+        AddToStats(job.mapTasks, mapStarted, job.stats.mapSeconds, job.stats);
+        cout << "All Map Tasks of Job " << job.id << " has been completed!" << endl;
+        SetJobState(job, masterslave::JOB_REDUCING);
+        auto mapsCompleted = chrono::steady_clock::now();
+        if (!WaitForTasks(job.reduceTasks))
+        {
+            FinishFailedJob(job);
+            return;
+        }
+        RetireTasks(job);
+        AddToStats(job.reduceTasks, reduceStarted, job.stats.reduceSeconds, job.stats);
+        job.stats.reduceTailSeconds = chrono::duration<double>(chrono::steady_clock::now() - mapsCompleted).count();
+        cout << "All Reduce Tasks of Job " << job.id << " has been completed!" << endl;
+
+        vector<vector<WordCount>> partitionTopWords;
+        for (auto &task : job.reduceTasks.tasks)
+            partitionTopWords.push_back(move(task.topWords));
+        vector<WordCount> topWords = MergeTopKWords(partitionTopWords, job.request.topk());
+        {
+            lock_guard<mutex> lock(stateMutex);
+            EvictSupersededEntries(job);
+        }
+        SaveManifest();
+
+        cout << "Job " << job.id << " has been completed, output is in " << job.request.outputdirectory() << endl;
+        cout << "Top " << job.request.topk() << " Words:" << endl;
+        for (auto &word : topWords)
+            cout << word.word() << " " << word.count() << endl;
+        PrintJobReport(job);
+        {
+            lock_guard<mutex> lock(stateMutex);
+            job.topWords = move(topWords);
+        }
+        SetJobState(job, masterslave::JOB_SUCCEEDED);
+    }
+
+    // Thread taking jobs off the queue one after the other. maxRunningJobs of these run, so that many jobs share the
+    // cluster at once.
+    void RunJobs()
+    {
+        while (true)
+        {
+            shared_ptr<Job> job;
             {
-                line += buffer[i];
-                ++read;
+                unique_lock<mutex> lock(stateMutex);
+                jobQueued.wait(lock, [this]()
+                               { return !jobQueue.empty(); });
+                job = jobQueue.front();
+                jobQueue.pop_front();
             }
+            RunJob(*job);
         }
-        return read;
     }
 
-    void PrintTopKWords(string keysForSorting)
+    // Queuing a job, its map output is kept on the slaves in a working directory named after the job
+    shared_ptr<Job> QueueJob(const SubmitJobRequest &request)
+    {
+        lock_guard<mutex> lock(stateMutex);
+        shared_ptr<Job> job(new Job());
+        job->id = nextJobID++;
+        job->request = request;
+        job->workDirectory = "/jobs/job-" + to_string(job->id) + "/";
+        job->splitSize = splitSize;
+        job->delimiters = delimiters;
+        job->state = masterslave::JOB_QUEUED;
+        job->mapTasks.name = "Job " + to_string(job->id) + " Map";
+        job->mapTasks.job = job.get();
+        job->reduceTasks.name = "Job " + to_string(job->id) + " Reduce";
+        job->reduceTasks.job = job.get();
+        jobs[job->id] = job;
+        jobQueue.push_back(job);
+        jobQueued.notify_one();
+        return job;
+    }
+
+    Status SubmitJob(ServerContext *context, const SubmitJobRequest *request, SubmitJobResponse *response) override
     {
-        hdfsFS fs = hdfsConnect("default", 9870);
-        if (fs == NULL)
+        if (request->inputpaths_size() == 0)
+            return Status(grpc::StatusCode::INVALID_ARGUMENT, "No input paths given");
+        if (request->outputdirectory().empty())
+            return Status(grpc::StatusCode::INVALID_ARGUMENT, "No output directory given");
+        if (request->topk() < 0 || request->numofreducers() < 0)
+            return Status(grpc::StatusCode::INVALID_ARGUMENT, "Negative K or number of reducers");
+        SubmitJobRequest job = *request;
+        if (job.outputdirectory().back() != '/')
+            job.set_outputdirectory(job.outputdirectory() + "/");
+        response->set_jobid(QueueJob(job)->id);
+        cout << "Job " << response->jobid() << " has been submitted" << endl;
+        return Status::OK;
+    }
+
+    Status GetJobStatus(ServerContext *context, const GetJobStatusRequest *request, GetJobStatusResponse *response) override
+    {
+        lock_guard<mutex> lock(stateMutex);
+        auto jobsItr = jobs.find(request->jobid());
+        if (jobsItr == jobs.end())
+            return Status(grpc::StatusCode::NOT_FOUND, "No job with id " + to_string(request->jobid()));
+        Job &job = *jobsItr->second;
+        response->set_state(job.state);
+        response->set_error(job.error);
+        response->set_maptasks(job.mapTasks.tasks.size());
+        response->set_completedmaptasks(job.mapTasks.completed);
+        response->set_reducetasks(job.reduceTasks.tasks.size());
+        response->set_completedreducetasks(job.reduceTasks.completed);
+        response->set_cachedsplits(job.cachedSplits);
+        for (auto &word : job.topWords)
+            *response->add_topwords() = word;
+        return Status::OK;
+    }
+
+    // Called by reducers started before all maps of their job had completed. Blocks until a map the reducer does not
+    // know of yet has completed, or mapWaitTimeout has passed and the reducer asks again.
+    Status WaitForMaps(ServerContext *context, const WaitForMapsRequest *request, WaitForMapsResponse *response) override
+    {
+        unique_lock<mutex> lock(stateMutex);
+        auto jobsItr = jobs.find(request->jobid());
+        if (jobsItr == jobs.end())
+            return Status(grpc::StatusCode::NOT_FOUND, "No job with id " + to_string(request->jobid()));
+        shared_ptr<Job> job = jobsItr->second;
+        mapCompleted.wait_for(lock, mapWaitTimeout, [&]()
+                              { return job->mapLocations.size() > request->after() || context->IsCancelled(); });
+        for (size_t i = request->after(); i < job->mapLocations.size(); i++)
+            *response->add_maps() = job->mapLocations[i];
+        return Status::OK;
+    }
+
+    // Called by reducers that could not fetch the output of a completed map, because it is missing or corrupt or its
+    // slave does not answer. The map is run again ahead of the queued tasks and its output dropped from the manifest.
+    // The slave itself is left alone, its heartbeats tell whether it is lost.
+    Status ReportLostMapOutput(ServerContext *context, const ReportLostMapOutputRequest *request, ReportLostMapOutputResponse *response) override
+    {
+        lock_guard<mutex> lock(stateMutex);
+        response->set_rerun(false);
+        auto jobsItr = jobs.find(request->jobid());
+        if (jobsItr == jobs.end())
+            return Status(grpc::StatusCode::NOT_FOUND, "No job with id " + to_string(request->jobid()));
+        Job &job = *jobsItr->second;
+        TaskGroup &group = job.mapTasks;
+        const MapLocation &lost = request->location();
+        if (lost.split() < 0 || lost.split() >= group.tasks.size())
+            return Status(grpc::StatusCode::INVALID_ARGUMENT, "Job " + to_string(job.id) + " has no split " + to_string(lost.split()));
+        Task &task = group.tasks[lost.split()];
+        // Reported before by another reducer, or the job is done with its maps
+        if (group.failed || find(runningGroups.begin(), runningGroups.end(), &group) == runningGroups.end() || !task.completed ||
+            task.location.address() != lost.address() || task.location.directory() != lost.directory())
+            return Status::OK;
+
+        cout << "Output of " << group.name << " Task " << task.id << " on " << lost.address() << " was reported lost (" << request->error() << "), running it again" << endl;
+        auto manifestItr = manifest.find(SplitKey(SegmentsKey(task.mapRequest), task.mapRequest.numofpartitions(), PartitioningHash(task.mapRequest)));
+        if (manifestItr != manifest.end() && manifestItr->second.address == lost.address() && manifestItr->second.directory == lost.directory())
+            EvictManifestEntry(manifestItr);
+        for (auto &location : job.mapLocations)
         {
-            cout << "Error while connecting to HDFS..." << endl;
+            if (location.split() == lost.split() && location.address() == lost.address())
+                location.clear_address();
         }
-        string path = "/files/";
-        string fileprefix = "output-";
+        task.completed = false;
+        --group.completed;
+        pendingTasks.push_front(&task);
+        WakeScheduler();
+        response->set_rerun(true);
+        return Status::OK;
+    }
 
-        map<int, string> word_counts;
-        for (int i = 0; i < keysForSorting.size(); i++)
+    // Asking every slave for the metrics of the tasks of a job it has run. Slaves that do not answer in time are left
+    // out.
+    vector<pair<string, GetMetricsResponse>> CollectMetrics(int64_t jobID)
+    {
+        vector<pair<int, Slave>> slaves;
         {
-            string fileloc = path + fileprefix + keysForSorting[i] + ".txt";
-            hdfsFile file = hdfsOpenFile(fs, fileloc.c_str(), O_RDONLY, 0, 0, 0);
-            if (!file)
+            lock_guard<mutex> lock(stateMutex);
+            slaves.assign(Slaves.begin(), Slaves.end());
+        }
+        vector<pair<string, GetMetricsResponse>> metrics;
+        for (auto &slave : slaves)
+        {
+            GetMetricsRequest request;
+            GetMetricsResponse response;
+            request.set_jobid(jobID);
+            ClientContext context;
+            context.set_deadline(chrono::system_clock::now() + chrono::seconds(2));
+            Status status = slave.second.stub->GetMetrics(&context, request, &response);
+            if (!status.ok())
             {
-                cout << "Failed to open file " << fileloc << endl;
+                cout << "No metrics from Slave: " << slave.second.address << " Error:" << status.error_message() << endl;
                 continue;
             }
-            char buffer[1024];
-            int bytesRead = 0;
-            while ((bytesRead = hdfsRead(fs, file, buffer, 1024)) > 0)
+            metrics.push_back({slave.second.address, move(response)});
+        }
+        return metrics;
+    }
+
+    static double Seconds(int64_t micros) { return micros / 1e6; }
+    static double Megabytes(int64_t bytes) { return bytes / (1024.0 * 1024.0); }
+
+    // End of job report: the phase durations seen by the master, where the time of the tasks went, the throughput of
+    // every slave and the slowest tasks
+    void PrintJobReport(const Job &job)
+    {
+        const JobStats &stats = job.stats;
+        vector<pair<string, GetMetricsResponse>> metrics = CollectMetrics(job.id);
+        cout << fixed << setprecision(2);
+        cout << "---------------------------- Job " << job.id << " Report ----------------------------" << endl;
+        cout << "Map Phase: " << stats.mapSeconds << "s, Reduce Phase: " << stats.reduceSeconds << "s ("
+             << stats.reduceTailSeconds << "s of it after the last Map)" << endl;
+
+        // Phase times summed over the successful tasks, attempts that failed or lost to another attempt are only counted
+        TaskMetrics mapTotal, reduceTotal;
+        int numOfMaps = 0, numOfReduces = 0, numOfFailed = 0;
+        vector<pair<string, const TaskMetrics *>> tasks; // (slave address, task) of every successful task
+        for (auto &slave : metrics)
+        {
+            int64_t bytesRead = 0, busyMicros = 0, peakMemory = 0;
+            int slaveMaps = 0, slaveReduces = 0;
+            for (auto &task : slave.second.tasks())
             {
-                int bufferRead = 0;
-                string line;
-                bool isFullLine = false;
-                bufferRead += getline(line, buffer, bytesRead, bufferRead, isFullLine);
-                while (isFullLine)
+                bytesRead += task.bytesread();
+                busyMicros += task.totalmicros();
+                peakMemory = max(peakMemory, task.peakmemory());
+                if (!task.succeeded())
                 {
-                    if (!line.empty())
-                    {
-                        string word;
-                        int count;
-                        stringstream lineStream(line);
-                        lineStream >> word >> count;
-                        word_counts[count] = word;
-                    }
-                    bufferRead += getline(line, buffer, bytesRead, bufferRead, isFullLine);
+                    ++numOfFailed;
+                    continue;
                 }
+                TaskMetrics &total = task.type() == "Map" ? mapTotal : reduceTotal;
+                (task.type() == "Map" ? numOfMaps : numOfReduces)++;
+                (task.type() == "Map" ? slaveMaps : slaveReduces)++;
+                total.set_bytesread(total.bytesread() + task.bytesread());
+                total.set_recordsread(total.recordsread() + task.recordsread());
+                total.set_recordsemitted(total.recordsemitted() + task.recordsemitted());
+                total.set_byteswritten(total.byteswritten() + task.byteswritten());
+                total.set_readmicros(total.readmicros() + task.readmicros());
+                total.set_tokenizemicros(total.tokenizemicros() + task.tokenizemicros());
+                total.set_aggregatemicros(total.aggregatemicros() + task.aggregatemicros());
+                total.set_writemicros(total.writemicros() + task.writemicros());
+                total.set_fetchmicros(total.fetchmicros() + task.fetchmicros());
+                tasks.push_back({slave.first, &task});
             }
-            hdfsCloseFile(fs, file);
+            cout << "Slave: " << slave.first << " ran " << slaveMaps << " Map and " << slaveReduces << " Reduce Tasks, read "
+                 << Megabytes(bytesRead) << " MB in " << Seconds(busyMicros) << "s ("
+                 << (busyMicros > 0 ? Megabytes(bytesRead) / Seconds(busyMicros) : 0.0) << " MB/s), largest task "
+                 << Megabytes(peakMemory) << " MB, process peak " << Megabytes(slave.second.peakrss()) << " MB" << endl;
+        }
+        cout << "Map Tasks (" << numOfMaps << "): " << Megabytes(mapTotal.bytesread()) << " MB, " << mapTotal.recordsread() << " words in, "
+             << mapTotal.recordsemitted() << " records out. Thread time in Read " << Seconds(mapTotal.readmicros()) << "s, Tokenize "
+             << Seconds(mapTotal.tokenizemicros()) << "s, Aggregate " << Seconds(mapTotal.aggregatemicros()) << "s, Write "
+             << Seconds(mapTotal.writemicros()) << "s" << endl;
+        cout << "Reduce Tasks (" << numOfReduces << "): " << Megabytes(reduceTotal.bytesread()) << " MB, " << reduceTotal.recordsread()
+             << " records in, " << reduceTotal.recordsemitted() << " words out. Thread time in Fetch " << Seconds(reduceTotal.fetchmicros())
+             << "s, Aggregate " << Seconds(reduceTotal.aggregatemicros()) << "s, Write " << Seconds(reduceTotal.writemicros()) << "s" << endl;
+        if (numOfFailed > 0)
+            cout << numOfFailed << " attempts failed or were cancelled" << endl;
+
+        // The gap between the time seen by the master and the time spent on the slave is RPC and queueing overhead
+        const int numOfSlowest = 5;
+        sort(tasks.begin(), tasks.end(), [](const pair<string, const TaskMetrics *> &a, const pair<string, const TaskMetrics *> &b)
+             { return a.second->totalmicros() > b.second->totalmicros(); });
+        cout << "Slowest Tasks:" << endl;
+        for (int i = 0; i < numOfSlowest && i < tasks.size(); i++)
+        {
+            const TaskMetrics &task = *tasks[i].second;
+            auto masterSeconds = stats.taskSeconds.find({task.type(), (int)task.id()});
+            cout << "  " << task.type() << " " << task.id() << " (Attempt " << task.attempt() << ") on " << tasks[i].first << ": "
+                 << Seconds(task.totalmicros()) << "s on the slave";
+            if (masterSeconds != stats.taskSeconds.end())
+                cout << ", " << masterSeconds->second << "s seen by the master";
+            cout << ". Read " << Seconds(task.readmicros()) << "s, Tokenize " << Seconds(task.tokenizemicros()) << "s, Aggregate "
+                 << Seconds(task.aggregatemicros()) << "s, Write " << Seconds(task.writemicros()) << "s, Fetch "
+                 << Seconds(task.fetchmicros()) << "s, " << Megabytes(task.peakmemory()) << " MB memory" << endl;
         }
-        int k;
-        cout << "Enter value of K: ";
-        cin >> k;
-        int i = 0;
 
-        hdfsDisconnect(fs);
-        for (map<int, string>::reverse_iterator itr = word_counts.rbegin(); itr != word_counts.rend(); itr++)
+        // Durations of all tasks since the slaves started, bucket i holding tasks of less than 2^i ms
+        vector<int64_t> mapDurations, reduceDurations;
+        for (auto &slave : metrics)
+        {
+            mapDurations.resize(max<size_t>(mapDurations.size(), slave.second.mapdurations_size()));
+            reduceDurations.resize(max<size_t>(reduceDurations.size(), slave.second.reducedurations_size()));
+            for (int i = 0; i < slave.second.mapdurations_size(); i++)
+                mapDurations[i] += slave.second.mapdurations(i);
+            for (int i = 0; i < slave.second.reducedurations_size(); i++)
+                reduceDurations[i] += slave.second.reducedurations(i);
+        }
+        auto printDurations = [](const string &name, const vector<int64_t> &buckets)
         {
-            if (i == k)
+            cout << name << " Task Durations since the Slaves started:";
+            for (int i = 0; i < buckets.size(); i++)
             {
-                break;
+                if (buckets[i] > 0)
+                    cout << " <" << (int64_t(1) << i) << "ms: " << buckets[i];
             }
-            cout << itr->second << " " << itr->first << endl;
-            i++;
-        }
+            cout << endl;
+        };
+        printDurations("Map", mapDurations);
+        printDurations("Reduce", reduceDurations);
+        cout << "========================================================================" << endl;
+        cout << defaultfloat << setprecision(6);
     }
 
     void Interface()
@@ -462,6 +1952,8 @@ public:
             cout << "3. To Change the Control Interval." << endl;
             cout << "4. To Reprint the Interface With Clearing the Screen." << endl;
             cout << "5. To Close the Server and Exit" << endl;
+            cout << "6. To Change the Map Split Size." << endl;
+            cout << "7. To Change the Word Delimiters." << endl;
             cin >> option;
             if (option == 1)
             {
@@ -469,14 +1961,21 @@ public:
             }
             else if (option == 2)
             {
-                int numOfMaps = AssignMapTasks();
-                if (numOfMaps > 0)
-                {
-                    string keyForSorting = AssignReduceTasks(numOfMaps);
-                    PrintTopKWords(keyForSorting);
-                }
-                else
-                    cout << "There is no Slave to give Map Task to." << endl;
+                // The number of most frequent words to report is part of the job, reducers return them with their result
+                int k;
+                cout << "Enter value of K: ";
+                cin >> k;
+                // Jobs of the menu count the default input into /files/ and go through the same queue as submitted jobs
+                SubmitJobRequest request;
+                request.add_inputpaths("/files/US_AirLines.txt");
+                request.set_outputdirectory("/files/");
+                request.set_topk(k);
+                shared_ptr<Job> job = QueueJob(request);
+                unique_lock<mutex> lock(stateMutex);
+                jobFinished.wait(lock, [&job]()
+                                 { return job->state == masterslave::JOB_SUCCEEDED || job->state == masterslave::JOB_FAILED; });
+                if (job->state == masterslave::JOB_FAILED)
+                    cout << "Job " << job->id << " failed: " << job->error << endl;
             }
             else if (option == 3)
             {
@@ -494,6 +1993,23 @@ public:
                 cout << "Shutting Down The Server by Killing the Process." << endl;
                 exit(0);
             }
+            else if (option == 6)
+            {
+                int64_t size;
+                cout << "Enter the new Split Size in MB (0 for the Storage Block Size): ";
+                cin >> size;
+                lock_guard<mutex> lock(stateMutex);
+                splitSize = size * 1024 * 1024;
+            }
+            else if (option == 7)
+            {
+                int choice;
+                cout << "1. Split Words on Whitespace Only." << endl;
+                cout << "2. Split Words on Whitespace and Punctuation." << endl;
+                cin >> choice;
+                lock_guard<mutex> lock(stateMutex);
+                delimiters = choice == 2 ? DelimiterSet::punctuation : "";
+            }
             else
             {
                 cout << "Incorrect Option Selected. Select Again!" << endl;
@@ -505,14 +2021,27 @@ public:
 int main(int argc, char **argv)
 {
     setenv("CLASSPATH", "/home/sabooh/hadoop-3.3.5/etc/hadoop:/home/sabooh/hadoop-3.3.5/share/hadoop/common/*:/home/sabooh/hadoop-3.3.5/share/hadoop/common/lib/*:/home/sabooh/hadoop-3.3.5/share/hadoop/hdfs/*:/home/sabooh/hadoop-3.3.5/share/hadoop/hdfs/lib/*:/home/sabooh/hadoop-3.3.5/share/hadoop/mapreduce/*:/home/sabooh/hadoop-3.3.5/share/hadoop/mapreduce/lib/*", 1);
-    Master master;
+    // Optional argument selecting the storage backend, e.g. "local:/data" to run without HDFS
+    string storageSpec = argc >= 2 ? argv[1] : "hdfs";
+    unique_ptr<Storage> storage = Storage::Create(storageSpec);
+    if (!storage)
+    {
+        cout << "Unknown storage backend: " << storageSpec << endl;
+        return 1;
+    }
+    cout << "Using storage backend " << storage->Name() << endl;
+    Master master(move(storage));
     ServerBuilder builder;
     builder.AddListeningPort("0.0.0.0:50056", grpc::InsecureServerCredentials());
     builder.RegisterService(&master);
     unique_ptr<Server> server(builder.BuildAndStart());
     cout << "Server listening on 0.0.0.0:50056" << endl;
 
-    // thread control_thread(&Master::SendControlSignals, &master);
+    thread control_thread(&Master::SendControlSignals, &master);
+    thread scheduler_thread(&Master::Schedule, &master);
+    vector<thread> job_threads;
+    for (int i = 0; i < Master::maxRunningJobs; i++)
+        job_threads.emplace_back(&Master::RunJobs, &master);
     thread interface_thread(&Master::Interface, &master);
     server->Wait();
     return 0;
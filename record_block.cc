@@ -0,0 +1,158 @@
+#include "record_block.h"
+
+#include <zlib.h>
+
+#include <cstring>
+
+using namespace std;
+
+static void PutUint32(string &out, uint32_t value)
+{
+    char bytes[4] = {char(value), char(value >> 8), char(value >> 16), char(value >> 24)};
+    out.append(bytes, 4);
+}
+
+static uint32_t GetUint32(const char *data)
+{
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+    return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | uint32_t(bytes[3]) << 24;
+}
+
+static void PutVarint(string &out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out += char(value | 0x80);
+        value >>= 7;
+    }
+    out += char(value);
+}
+
+// Header layout, little endian: magic, codec and 3 reserved bytes, record count, raw length, stored length, checksum
+bool ReadBlockHeader(const char *data, size_t length, BlockHeader &header)
+{
+    if (length < BlockHeader::size || GetUint32(data) != BlockHeader::magic)
+        return false;
+    header.codec = data[4];
+    header.recordCount = GetUint32(data + 8);
+    header.rawLength = GetUint32(data + 12);
+    header.storedLength = GetUint32(data + 16);
+    header.checksum = GetUint32(data + 20);
+    return true;
+}
+
+void RecordBlockBuilder::Add(string_view word, int64_t count)
+{
+    PutVarint(payload, word.size());
+    payload.append(word.data(), word.size());
+    PutVarint(payload, count);
+    ++recordCount;
+}
+
+void RecordBlockBuilder::Finish(BlockCodec codec, string &out)
+{
+    string compressed;
+    const string *stored = &payload;
+    if (codec == CODEC_ZLIB)
+    {
+        // The fastest level, map output is compressed to save network and disk bandwidth rather than space
+        uLongf compressedLength = compressBound(payload.size());
+        compressed.resize(compressedLength);
+        if (compress2(reinterpret_cast<Bytef *>(&compressed[0]), &compressedLength, reinterpret_cast<const Bytef *>(payload.data()), payload.size(), Z_BEST_SPEED) == Z_OK &&
+            compressedLength < payload.size())
+        {
+            compressed.resize(compressedLength);
+            stored = &compressed;
+        }
+        else
+            codec = CODEC_NONE; // Incompressible records are stored as they are
+    }
+    else
+        codec = CODEC_NONE;
+
+    PutUint32(out, BlockHeader::magic);
+    out += char(codec);
+    out.append(3, '\0');
+    PutUint32(out, recordCount);
+    PutUint32(out, payload.size());
+    PutUint32(out, stored->size());
+    PutUint32(out, crc32(0, reinterpret_cast<const Bytef *>(stored->data()), stored->size()));
+    out += *stored;
+
+    payload.clear();
+    recordCount = 0;
+}
+
+string_view BlockPayload(const BlockHeader &header, const char *stored, string &scratch)
+{
+    if (crc32(0, reinterpret_cast<const Bytef *>(stored), header.storedLength) != header.checksum)
+        return string_view();
+    if (header.codec == CODEC_NONE)
+        return header.storedLength == header.rawLength ? string_view(stored, header.storedLength) : string_view();
+    // Deflate expands data at most 1032 times, a larger raw length comes from a damaged header
+    if (header.codec != CODEC_ZLIB || header.rawLength > uint64_t(header.storedLength) * 1032)
+        return string_view();
+    scratch.resize(header.rawLength);
+    uLongf rawLength = header.rawLength;
+    if (uncompress(reinterpret_cast<Bytef *>(&scratch[0]), &rawLength, reinterpret_cast<const Bytef *>(stored), header.storedLength) != Z_OK ||
+        rawLength != header.rawLength)
+        return string_view();
+    return string_view(scratch.data(), rawLength);
+}
+
+bool RecordBlockReader::NextBlock(string &block, BlockHeader &header)
+{
+    block.resize(BlockHeader::size);
+    int64_t bytesRead = file.Read(&block[0], BlockHeader::size);
+    if (bytesRead == 0 && !file.Failed())
+        return false;
+    if (bytesRead != BlockHeader::size || !ReadBlockHeader(block.data(), block.size(), header))
+    {
+        failed = true;
+        return false;
+    }
+    // A damaged header could claim a block of up to 4 GB, which must not be allocated before it is found to be cut off
+    if (header.storedLength > file.End() - file.Position())
+    {
+        failed = true;
+        return false;
+    }
+    block.resize(BlockHeader::size + header.storedLength);
+    if (file.Read(&block[BlockHeader::size], header.storedLength) != header.storedLength)
+    {
+        failed = true;
+        return false;
+    }
+    return true;
+}
+
+bool RecordBlockReader::Next(string_view &word, int64_t &count)
+{
+    while (recordsLeft == 0)
+    {
+        // The record count is not covered by the checksum, records left over mean it is wrong
+        if (payloadPosition != payload.size())
+        {
+            failed = true;
+            return false;
+        }
+        BlockHeader header;
+        if (!NextBlock(block, header))
+            return false;
+        payload = BlockPayload(header, block.data() + BlockHeader::size, scratch);
+        if (payload.data() == nullptr)
+        {
+            failed = true;
+            return false;
+        }
+        payloadPosition = 0;
+        recordsLeft = header.recordCount;
+    }
+    if (!NextRecord(payload, payloadPosition, word, count))
+    {
+        failed = true;
+        return false;
+    }
+    --recordsLeft;
+    return true;
+}
@@ -0,0 +1,143 @@
+#ifndef RECORD_BLOCK_H
+#define RECORD_BLOCK_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "storage.h"
+
+// Binary format of intermediate (word, count) data: a file is a sequence of self-contained blocks, each made of a
+// fixed size header followed by the stored payload. The payload holds the records of the block as
+//   varint length of the word, bytes of the word, varint count
+// and is optionally compressed. As every header gives the stored size of its block, readers can skip whole blocks or
+// hand them to different threads, and a block can be sent over the network without touching its records.
+
+enum BlockCodec : uint8_t
+{
+    CODEC_NONE = 0,
+    CODEC_ZLIB = 1,
+};
+
+struct BlockHeader
+{
+    static const uint32_t magic = 0x3142524d; // "MRB1"
+    static const size_t size = 24;
+
+    uint8_t codec;
+    uint32_t recordCount;
+    uint32_t rawLength;    // Bytes of the payload once decompressed
+    uint32_t storedLength; // Bytes of the payload following the header
+    uint32_t checksum;     // CRC-32 of the stored payload
+};
+
+// Parsing the header at the start of data. Returns false if data is shorter than a header or is not a block.
+bool ReadBlockHeader(const char *data, size_t length, BlockHeader &header);
+
+// Collecting records into a block
+class RecordBlockBuilder
+{
+    std::string payload;
+    uint32_t recordCount;
+
+public:
+    RecordBlockBuilder() : recordCount(0) {}
+
+    void Add(std::string_view word, int64_t count);
+
+    uint32_t RecordCount() const { return recordCount; }
+    size_t RawSize() const { return payload.size(); }
+
+    // Appending the records added so far to out as one block and starting a new block
+    void Finish(BlockCodec codec, std::string &out);
+};
+
+// Verifying and decompressing the stored payload of a block, returns a view of the raw records that stays valid
+// until scratch is changed, or a null view if the block is corrupt
+std::string_view BlockPayload(const BlockHeader &header, const char *stored, std::string &scratch);
+
+// Decoding the next record of a raw payload starting at position, which is moved past it. False at the end of the
+// payload or if the record is cut off.
+inline bool NextRecord(std::string_view payload, size_t &position, std::string_view &word, int64_t &count)
+{
+    auto readVarint = [&payload, &position](uint64_t &value)
+    {
+        value = 0;
+        for (int shift = 0; position < payload.size() && shift < 64; shift += 7)
+        {
+            uint8_t byte = payload[position++];
+            value |= uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    };
+    uint64_t length, value;
+    if (!readVarint(length) || length > payload.size() - position)
+        return false;
+    word = payload.substr(position, length);
+    position += length;
+    if (!readVarint(value))
+        return false;
+    count = value;
+    return true;
+}
+
+// Calling function(word, count) for every record of the whole blocks at the start of data. Returns the bytes of data
+// they make up, so anything left is a cut off or invalid block, or -1 if a block is corrupt.
+template <typename Function>
+int64_t DecodeBlocks(const char *data, size_t length, std::string &scratch, Function function)
+{
+    size_t position = 0;
+    BlockHeader header;
+    while (ReadBlockHeader(data + position, length - position, header) &&
+           BlockHeader::size + header.storedLength <= length - position)
+    {
+        std::string_view payload = BlockPayload(header, data + position + BlockHeader::size, scratch);
+        if (payload.data() == nullptr)
+            return -1;
+        size_t recordPosition = 0;
+        std::string_view word;
+        int64_t count;
+        for (uint32_t i = 0; i < header.recordCount; i++)
+        {
+            if (!NextRecord(payload, recordPosition, word, count))
+                return -1;
+            function(word, count);
+        }
+        // The record count is not covered by the checksum, records left over mean it is wrong
+        if (recordPosition != payload.size())
+            return -1;
+        position += BlockHeader::size + header.storedLength;
+    }
+    return position;
+}
+
+// Sequential reader of the blocks of a file, reading ahead in buffers of bufferSize bytes
+class RecordBlockReader
+{
+    PrefetchReader file;
+    std::string block;
+    std::string scratch;
+    std::string_view payload;
+    size_t payloadPosition;
+    uint32_t recordsLeft;
+    bool failed;
+
+public:
+    RecordBlockReader(InputFile &file, int64_t bufferSize) : file(file, 0, file.Size(), bufferSize), payloadPosition(0), recordsLeft(0), failed(false) {}
+
+    // Reading the next whole block, header included, into block. False at the end of the file or on an error.
+    bool NextBlock(std::string &block, BlockHeader &header);
+
+    // Moving to the next record, false at the end of the file or on an error. The word stays valid until the next call.
+    bool Next(std::string_view &word, int64_t &count);
+
+    // True if the file could not be read or holds a corrupt block
+    bool Failed() const { return failed; }
+
+    int64_t BufferMemory() const { return file.BufferMemory() + block.capacity() + scratch.capacity(); }
+};
+
+#endif
@@ -7,243 +7,953 @@
 #include <chrono>
 #include <vector>
 #include <map>
-#include <hdfs.h>
 #include <fstream>
 #include <map>
+#include <set>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <future>
+#include <algorithm>
+#include <cstdlib>
+#include <string_view>
+#include <queue>
+#include <csignal>
+#include <deque>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "storage.h"
+#include "thread_pool.h"
+#include "tokenizer.h"
+#include "wordcount_table.h"
+#include "record_block.h"
+#include "wordcount.h"
+#include "task_metrics.h"
 using grpc::ClientContext;
 using grpc::Server;
 using grpc::ServerBuilder;
 using grpc::ServerContext;
+using grpc::ServerWriter;
 using grpc::Status;
 using masterslave::ControlSignalRequest;
 using masterslave::ControlSignalResponse;
+using masterslave::FetchPartitionRequest;
+using masterslave::PartitionChunk;
+using masterslave::GetMetricsRequest;
+using masterslave::GetMetricsResponse;
+using masterslave::TaskMetrics;
+using masterslave::DeregisterSlaveRequest;
+using masterslave::DeregisterSlaveResponse;
 using masterslave::MasterService;
 using masterslave::RegisterSlaveRequest;
 using masterslave::RegisterSlaveResponse;
+using masterslave::WaitForMapsRequest;
+using masterslave::WaitForMapsResponse;
+using masterslave::ReportLostMapOutputRequest;
+using masterslave::ReportLostMapOutputResponse;
 using masterslave::SlaveService;
 
+using masterslave::MapLocation;
 using masterslave::MapRequest;
+using masterslave::Segment;
 using masterslave::MapResponse;
 using masterslave::ReduceRequest;
 using masterslave::ReduceResponse;
+using masterslave::WordCount;
 
 using namespace std;
 
-class Slave : public SlaveService::Service
+// Ordering of words by frequency, more frequent words first and words of equal count alphabetically, so every
+// reducer and the master agree on which words make it into a top-K list
+inline bool MoreFrequent(const pair<string, int64_t> &a, const pair<string, int64_t> &b)
+{
+    return a.second != b.second ? a.second > b.second : a.first < b.first;
+}
+
+// Keeping the k most frequent words added to it in a min-heap of size k, so selecting them is O(n log k) and needs no
+// copy of the whole partition. A word is only copied when it makes it into the heap.
+class TopKWords
 {
+    int64_t k;
+    priority_queue<pair<string, int64_t>, vector<pair<string, int64_t>>, decltype(&MoreFrequent)> heap;
+
 public:
-    Status ControlSignal(ServerContext *context, const ControlSignalRequest *request, ControlSignalResponse *response) override
+    TopKWords(int64_t k) : k(k), heap(&MoreFrequent) {}
+
+    void Add(string_view word, int64_t count)
     {
-        // cout << "Control Signal Received From Master" << endl;
-        return Status::OK;
+        if (k <= 0)
+            return;
+        if (heap.size() == k)
+        {
+            const pair<string, int64_t> &least = heap.top();
+            if (count < least.second || (count == least.second && word >= least.first))
+                return;
+            heap.pop();
+        }
+        heap.emplace(string(word), count);
     }
 
-    Status Map(ServerContext *context, const MapRequest *request, MapResponse *response) override
+    // The words ordered by descending count, leaves the heap empty
+    vector<pair<string, int64_t>> Result()
     {
-        string filepath = request->filepath();
-        string filename = request->filename();
-        int chunkSize = request->chunksize();
-        int chunkNumber = request->chunknumber();
-        cout << "Map Task Received by Master for File: " << filepath + filename << " on Chunk Number: " << chunkNumber << " with Chunk Size: " << chunkSize << endl;
+        vector<pair<string, int64_t>> topWords(heap.size());
+        for (size_t i = topWords.size(); i > 0; i--)
+        {
+            topWords[i - 1] = heap.top();
+            heap.pop();
+        }
+        return topWords;
+    }
+};
+
+// Sequential reader of a sorted run spilled by a reduce task
+class RunReader
+{
+    unique_ptr<InputFile> file;
+    RecordBlockReader reader;
+
+    // Smaller than the buffers of other readers as a reduce task may have many runs open at once
+    static const int64_t bufferSize = 1024 * 1024;
+
+public:
+    string_view word;
+    int64_t count;
+
+    RunReader(unique_ptr<InputFile> file) : file(move(file)), reader(*this->file, bufferSize), count(0) {}
+
+    // Moving to the next word of the run, false at the end of the run or on a read error. The word stays valid until
+    // the next call.
+    bool Next() { return reader.Next(word, count); }
+
+    bool Failed() { return reader.Failed(); }
+};
+
+// Word counts of a reduce task kept within a memory budget. Whenever the counts outgrow the budget they are written
+// to local disk as a run sorted by word and the memory is released. Merge combines the runs with the counts left in
+// memory, so the memory used stays the same however many distinct words the partition has. A budget of 0 keeps
+// everything in memory. Time spent spilling is added to the counters of the task.
+class ReduceCounts
+{
+    WordCountTable counts;
+    int64_t budget;
+    Storage &localStorage;
+    string runPrefix;
+    vector<string> runs;
+    bool failed;
+    TaskCounters &counters;
+    int64_t peakMemory;
 
-        hdfsFS fs = hdfsConnect("default", 9870);
-        if (fs == NULL)
+    bool Spill()
+    {
+        PhaseTimer timer(counters.writeNanos);
+        peakMemory = max(peakMemory, counts.MemoryUsed());
+        string runPath = runPrefix + to_string(runs.size()) + ".txt";
+        unique_ptr<OutputFile> run = localStorage.OpenOutput(runPath);
+        if (!run)
+            return false;
+        runs.push_back(runPath);
+        // Runs only live on local disk for the duration of the task, so they are not compressed
+        RecordBlockBuilder block;
+        string runBuffer;
+        for (auto &word : counts.Sorted())
         {
-            cout << "Error while connecting to HDFS..." << endl;
+            block.Add(word.first, word.second);
+            if (block.RawSize() >= 64 * 1024)
+            {
+                block.Finish(CODEC_NONE, runBuffer);
+                run->Write(runBuffer.data(), runBuffer.size());
+                runBuffer.clear();
+            }
         }
+        if (block.RecordCount() > 0)
+            block.Finish(CODEC_NONE, runBuffer);
+        run->Write(runBuffer.data(), runBuffer.size());
+        cout << "Spilled " << counts.Size() << " words to " << runPath << endl;
+        counts.Clear();
+        return run->Close();
+    }
 
-        // Opening input file in HDFS
-        hdfsFile input_file = hdfsOpenFile(fs, (filepath + filename).c_str(), O_RDONLY, 0, 0, 0);
-        if (!input_file)
+public:
+    ReduceCounts(int64_t budget, Storage &localStorage, string runPrefix, TaskCounters &counters)
+        : budget(budget), localStorage(localStorage), runPrefix(runPrefix), failed(false), counters(counters), peakMemory(0) {}
+    ~ReduceCounts()
+    {
+        for (auto &run : runs)
+            localStorage.Delete(run);
+    }
+
+    void Add(string_view word, int64_t count)
+    {
+        counts.Add(word, count);
+        if (budget > 0 && counts.MemoryUsed() >= budget && !failed)
+            failed = !Spill();
+    }
+
+    // False if a run could not be written
+    bool Failed() { return failed; }
+
+    // Bytes of the word counts in memory at their largest
+    int64_t PeakMemory() { return max(peakMemory, counts.MemoryUsed()); }
+
+    // Calling function(word, count) for every word in ascending order, with the counts of a word spilled to several
+    // runs added up. Returns false if a run could not be read.
+    template <typename Function>
+    bool Merge(Function function)
+    {
+        vector<pair<string_view, int64_t>> inMemory = counts.Sorted();
+        if (runs.empty())
         {
-            cout << "Failed to open input file " << (filepath + filename) << endl;
-            return Status(grpc::StatusCode::FAILED_PRECONDITION, "Failed to open Input File");
+            for (auto &word : inMemory)
+                function(word.first, word.second);
+            return true;
         }
 
-        // Opening output file in HDFS
-        string map_num = to_string(chunkNumber);
-        string outputpath = filepath + "map-" + map_num + ".txt";
-        hdfsFile output_file = hdfsOpenFile(fs, outputpath.c_str(), O_WRONLY | O_CREAT, 0, 0, 0);
-        if (!output_file)
+        // k-way merge of the runs and the sorted words in memory, source runs.size() being the words in memory
+        vector<unique_ptr<RunReader>> readers;
+        for (auto &run : runs)
         {
-            cout << "Failed to open output file " << outputpath << endl;
-            return Status(grpc::StatusCode::FAILED_PRECONDITION, "Failed to open Output File");
+            unique_ptr<InputFile> file = localStorage.OpenInput(run);
+            if (!file)
+                return false;
+            readers.emplace_back(new RunReader(move(file)));
         }
-        else
-            cout << "Opened output file successfully: " << outputpath << endl;
+        size_t inMemoryPosition = 0;
+        auto wordOf = [&](int source)
+        {
+            return source < readers.size() ? readers[source]->word : inMemory[inMemoryPosition].first;
+        };
+        auto greaterWord = [&](int a, int b)
+        { return wordOf(a) > wordOf(b); };
+        priority_queue<int, vector<int>, decltype(greaterWord)> heads(greaterWord);
+        for (int i = 0; i < readers.size(); i++)
+        {
+            if (readers[i]->Next())
+                heads.push(i);
+        }
+        if (!inMemory.empty())
+            heads.push(readers.size());
 
-        // Initializing required variables for buffer
-        bool checkRequired = false; // Check for Case 1 below
-        if (chunkNumber != 0)
+        string word;
+        int64_t count = 0;
+        while (!heads.empty())
+        {
+            int source = heads.top();
+            heads.pop();
+            string_view headWord = wordOf(source);
+            int64_t headCount = source < readers.size() ? readers[source]->count : inMemory[inMemoryPosition].second;
+            if (count > 0 && headWord != word)
+            {
+                function(string_view(word), count);
+                count = 0;
+            }
+            if (count == 0)
+                word.assign(headWord.data(), headWord.size());
+            count += headCount;
+            if (source < readers.size() ? readers[source]->Next() : ++inMemoryPosition < inMemory.size())
+                heads.push(source);
+        }
+        if (count > 0)
+            function(string_view(word), count);
+        for (auto &reader : readers)
         {
-            hdfsSeek(fs, input_file, chunkNumber * chunkSize - 1);
-            bool checkRequired = true;
+            if (reader->Failed())
+                return false;
         }
-        int bufferSize = ((1024 > chunkSize) ? chunkSize : 1024) + (checkRequired ? 1 : 0);
-        char buffer[bufferSize];
-        int bytesRead = 0;
-        int totalBytesRead = 0;
-        string word = "";
+        return true;
+    }
+};
+
+// Byte range of an open input file counted by one map thread
+struct InputRange
+{
+    InputFile *file;
+    int64_t start;
+    int64_t end;
+};
+
+class Slave : public SlaveService::Service
+{
+    string address;
+    unique_ptr<Storage> storage;      // Input and final output of jobs
+    unique_ptr<Storage> localStorage; // Map output, kept on this slave and served to reducers by FetchPartition
+    ThreadPool mapPool;               // Threads counting sub-ranges of map chunks in parallel
+    shared_ptr<MasterService::Stub> masterStub;
 
-        // Reading a buffer and writing to output file word by word
-        while ((bytesRead = hdfsRead(fs, input_file, buffer, bufferSize)) > 0)
+    // Stubs of the slaves map output is fetched from, one channel per slave is kept for all reduce tasks
+    mutex fetchStubsMutex;
+    map<string, shared_ptr<SlaveService::Stub>> fetchStubs;
+
+    // Load reported to the master with every heartbeat
+    int taskSlots; // Tasks this slave runs at once
+    atomic<int> runningTasks;
+    atomic<int64_t> bytesProcessed;
+
+    // Metrics of the most recent tasks, served to the master by GetMetrics
+    mutex metricsMutex;
+    deque<TaskMetrics> recentTasks;
+    int64_t nextTaskSequence;
+    DurationHistogram mapDurations;
+    DurationHistogram reduceDurations;
+    static const size_t maxRecentTasks = 1024;
+
+    // Map chunks are not split into sub-ranges smaller than this, as the threads would spend more time on setup
+    static const int64_t minRangeSize = 1024 * 1024;
+    // Buffer size for reading input and map output when the job does not give one
+    static const int64_t defaultReadBufferSize = 4 * 1024 * 1024;
+    // Time a reducer waits for the next message of a FetchPartition before taking the slave serving it for lost
+    static constexpr chrono::seconds fetchTimeout = chrono::seconds(20);
+    // A fetch failing with a transient error is tried again maxFetchRetries times, waiting fetchBackoff and then twice
+    // as long each time, before the output is reported lost. Other failures are reported at once.
+    static const int maxFetchRetries = 3;
+    static constexpr chrono::milliseconds fetchBackoff = chrono::milliseconds(500);
+
+    // Bytes of map output sent in one FetchPartition message, large enough to keep per message overhead low. Messages
+    // carry whole blocks, so a block larger than this is sent on its own.
+    static const int64_t fetchChunkSize = 1024 * 1024;
+
+    static string MapOutputPath(const string &maplocation, int64_t chunkNumber, int64_t partition)
+    {
+        return maplocation + "map-" + to_string(chunkNumber) + "-part-" + to_string(partition) + ".txt";
+    }
+
+    shared_ptr<SlaveService::Stub> FetchStub(const string &slaveAddress)
+    {
+        lock_guard<mutex> lock(fetchStubsMutex);
+        shared_ptr<SlaveService::Stub> &stub = fetchStubs[slaveAddress];
+        if (!stub)
+            stub = SlaveService::NewStub(grpc::CreateChannel(slaveAddress, grpc::InsecureChannelCredentials()));
+        return stub;
+    }
+
+    // Reading this reducer's partition of one map output, from local disk if this slave ran the map and otherwise
+    // streamed from the slave that did. Map output is read a block at a time, so waiting for blocks is counted as
+    // fetching and decoding them into the counts as aggregating. A fetch is cancelled with the reduce attempt and
+    // when the slave serving it has sent nothing for fetchTimeout, so a slave that has stopped answering cannot hold
+    // the reducer up indefinitely while a large partition still gets all the time it needs.
+    Status FetchMapOutput(ServerContext *serverContext, const string &maplocation, const MapLocation &location, int64_t partition, int64_t readBufferSize, ReduceCounts &wordcount, TaskCounters &counters)
+    {
+        const string &directory = location.directory().empty() ? maplocation : location.directory();
+        auto add = [&wordcount, &counters](string_view word, int64_t count)
+        {
+            wordcount.Add(word, count);
+            ++counters.recordsRead;
+        };
+        string scratch;
+        auto decode = [&](const string &blocks)
+        {
+            auto aggregateStart = chrono::steady_clock::now();
+            int64_t writeNanos = counters.writeNanos;
+            bool decoded = DecodeBlocks(blocks.data(), blocks.size(), scratch, add) == blocks.size();
+            counters.aggregateNanos += NanosSince(aggregateStart) - (counters.writeNanos - writeNanos);
+            counters.bytesRead += blocks.size();
+            return decoded;
+        };
+        auto fetchStart = chrono::steady_clock::now();
+        if (location.address() == address)
         {
-            int i = 0;
-            // Case 1: if start of chunk is an incomplete word then we skip the incomplete word
-            if (checkRequired && bytesRead == bufferSize)
+            string filename = MapOutputPath(directory, location.chunknumber(), partition);
+            unique_ptr<InputFile> input_file = localStorage->OpenInput(filename);
+            if (!input_file)
+                return Status(grpc::StatusCode::NOT_FOUND, "Failed to open Map Output " + filename);
+            RecordBlockReader reader(*input_file, readBufferSize);
+            string block;
+            BlockHeader header;
+            bool corrupt = false;
+            while (reader.NextBlock(block, header))
             {
-                checkRequired = false;
-                while (!(buffer[i] == ' ' || buffer[i] == '\n'))
-                    i++;
-                i++;
-                bytesRead--; // Cause we added 1 for Checking previous letter of start of chunk
+                counters.fetchNanos += NanosSince(fetchStart);
+                corrupt = !decode(block);
+                if (corrupt)
+                    break;
+                fetchStart = chrono::steady_clock::now();
             }
-            for (; i < bytesRead; i++)
+            counters.peakMemory = max<int64_t>(counters.peakMemory, reader.BufferMemory() + block.capacity() + scratch.capacity());
+            if (reader.Failed() || corrupt)
+                return Status(grpc::StatusCode::DATA_LOSS, "Failed to read Map Output " + filename);
+            return Status::OK;
+        }
+
+        FetchPartitionRequest request;
+        request.set_maplocation(directory);
+        request.set_chunknumber(location.chunknumber());
+        request.set_partition(partition);
+        unique_ptr<ClientContext> context = ClientContext::FromServerContext(*serverContext);
+        // Only the time spent waiting for a message counts against fetchTimeout, decoding and spilling do not
+        mutex watchdogMutex;
+        condition_variable watchdogWake;
+        bool waiting = true, finished = false, idle = false;
+        auto waitingSince = chrono::steady_clock::now();
+        thread watchdog([&]()
+                        {
+                            unique_lock<mutex> lock(watchdogMutex);
+                            while (!finished)
+                            {
+                                if (!waiting)
+                                    watchdogWake.wait(lock);
+                                else if (chrono::steady_clock::now() - waitingSince < fetchTimeout)
+                                    watchdogWake.wait_until(lock, waitingSince + fetchTimeout);
+                                else
+                                {
+                                    idle = true;
+                                    context->TryCancel();
+                                    return;
+                                }
+                            } });
+        auto setWaiting = [&](bool value)
+        {
+            lock_guard<mutex> lock(watchdogMutex);
+            waiting = value;
+            waitingSince = chrono::steady_clock::now();
+            watchdogWake.notify_one();
+        };
+        unique_ptr<grpc::ClientReader<PartitionChunk>> reader(FetchStub(location.address())->FetchPartition(context.get(), request));
+        PartitionChunk chunk;
+        bool corrupt = false;
+        while (reader->Read(&chunk))
+        {
+            setWaiting(false);
+            counters.fetchNanos += NanosSince(fetchStart);
+            counters.peakMemory = max<int64_t>(counters.peakMemory, chunk.data().capacity() + scratch.capacity());
+            if (!corrupt && !decode(chunk.data()))
             {
-                if ((buffer[i] == ' ' || buffer[i] == '\n') && word != "")
-                {
-                    hdfsWrite(fs, output_file, word.c_str(), word.size());
-                    hdfsWrite(fs, output_file, "\n", 1);
-                    // cout << word << endl;
-                    word.clear();
-                    checkRequired = false;
-                }
-                else
-                {
-                    word += buffer[i];
-                    checkRequired = true;
-                }
+                corrupt = true;
+                context->TryCancel();
             }
+            fetchStart = chrono::steady_clock::now();
+            setWaiting(true);
+        }
+        Status status = reader->Finish();
+        counters.fetchNanos += NanosSince(fetchStart);
+        {
+            lock_guard<mutex> lock(watchdogMutex);
+            finished = true;
+            watchdogWake.notify_one();
+        }
+        watchdog.join();
+        if (idle)
+            return Status(grpc::StatusCode::DEADLINE_EXCEEDED, "No Map Output from " + location.address() + " for " + to_string(fetchTimeout.count()) + "s");
+        if (corrupt)
+            return Status(grpc::StatusCode::DATA_LOSS, "Corrupt block in Map Output from " + location.address());
+        return status;
+    }
+
+public:
+    Slave(string address, unique_ptr<Storage> storage, unique_ptr<Storage> localStorage, int mapThreads, int taskSlots)
+        : address(address), storage(move(storage)), localStorage(move(localStorage)), mapPool(mapThreads), masterStub(MasterService::NewStub(grpc::CreateChannel("0.0.0.0:50056", grpc::InsecureChannelCredentials()))), taskSlots(taskSlots), runningTasks(0), bytesProcessed(0), nextTaskSequence(1) {}
+
+    // Heartbeat of the master, answered with the load of this slave so the master can prefer the least loaded slaves.
+    // It also carries the job directories whose map output the master no longer needs.
+    Status ControlSignal(ServerContext *context, const ControlSignalRequest *request, ControlSignalResponse *response) override
+    {
+        for (auto &directory : request->removedirectories())
+        {
+            if (RemoveDirectory(directory))
+                cout << "Removed Job Directory " << directory << endl;
+        }
+        int running = runningTasks;
+        response->set_runningtasks(running);
+        response->set_freeslots(max(0, taskSlots - running));
+        double load;
+        if (getloadavg(&load, 1) == 1)
+            response->set_cpuload(load / max(1u, thread::hardware_concurrency()));
+        response->set_memoryused(ResidentMemory());
+        response->set_bytesprocessed(bytesProcessed);
+        return Status::OK;
+    }
 
-            totalBytesRead += bytesRead;
-            // Case 2: if end of chunk is incomplete word then we complete reading the word
+    // Removing a directory of the local disk with everything below it, false if it does not exist
+    bool RemoveDirectory(const string &directory)
+    {
+        vector<FileInfo> entries;
+        if (!localStorage->ListDirectory(directory, entries))
+            return false;
+        for (auto &entry : entries)
+        {
+            if (entry.isDirectory)
+                RemoveDirectory(entry.path);
+            else
+                localStorage->Delete(entry.path);
+        }
+        return localStorage->Delete(directory);
+    }
+
+    // Bytes of memory currently resident in this process, 0 if /proc is not available
+    static int64_t ResidentMemory()
+    {
+        ifstream statm("/proc/self/statm");
+        int64_t size, resident;
+        if (!(statm >> size >> resident))
+            return 0;
+        return resident * sysconf(_SC_PAGESIZE);
+    }
 
-            if (checkRequired && totalBytesRead == chunkSize && word != "")
+    Status Map(ServerContext *context, const MapRequest *request, MapResponse *response) override
+    {
+        auto started = chrono::steady_clock::now();
+        TaskCounters counters;
+        ++runningTasks;
+        Status status = RunMap(context, request, response, counters);
+        --runningTasks;
+        RecordTask("Map", request->jobid(), request->chunknumber(), request->attempt(), status.ok(), counters, NanosSince(started));
+        return status;
+    }
+
+    Status RunMap(ServerContext *context, const MapRequest *request, MapResponse *response, TaskCounters &counters)
+    {
+        string filepath = request->filepath();
+        // Every job keeps its map output in a directory of its own, so jobs running at once do not overwrite each other
+        string workDirectory = request->workdirectory().empty() ? filepath : request->workdirectory();
+        int chunkNumber = request->chunknumber();
+        int64_t combinerBudget = request->combinerbudget();
+        int numOfPartitions = request->numofpartitions() > 0 ? request->numofpartitions() : 1;
+        if (request->splitpoints_size() > 0 && (request->splitpoints_size() != numOfPartitions - 1 || !is_sorted(request->splitpoints().begin(), request->splitpoints().end())))
+            return Status(grpc::StatusCode::INVALID_ARGUMENT, "Split points must be numofpartitions - 1 sorted words");
+        // Words are separated by whitespace and any further delimiters the job asks for, e.g. punctuation
+        DelimiterSet delimiters(DelimiterSet::whitespace + request->delimiters());
+        int64_t readBufferSize = request->readbuffersize() > 0 ? request->readbuffersize() : defaultReadBufferSize;
+
+        // A split is one or more byte ranges of input files, several small files being packed into one split. Requests
+        // without segments give a single range of one file.
+        vector<Segment> segments(request->segments().begin(), request->segments().end());
+        if (segments.empty())
+        {
+            Segment segment;
+            segment.set_path(filepath + request->filename());
+            segment.set_offset(request->offset());
+            segment.set_length(request->length());
+            segments.push_back(segment);
+        }
+        vector<unique_ptr<InputFile>> input_files;
+        vector<InputRange> inputs;
+        int64_t chunkSize = 0;
+        for (auto &segment : segments)
+        {
+            // Opening input file in Storage
+            unique_ptr<InputFile> input_file = storage->OpenInput(segment.path());
+            if (!input_file)
             {
-                char c;
-                while (hdfsAvailable(fs, input_file) > 0)
-                {
-                    bytesRead = hdfsRead(fs, input_file, &c, 1);
-                    if (!(c == ' ' || c == '\n'))
-                        word += buffer[i];
-                    else
-                        break;
-                }
-                hdfsWrite(fs, output_file, word.c_str(), word.size());
-                hdfsWrite(fs, output_file, "\n", 1);
+                cout << "Failed to open input file " << segment.path() << endl;
+                return Status(grpc::StatusCode::FAILED_PRECONDITION, "Failed to open Input File " + segment.path());
+            }
+            int64_t end = min(segment.offset() + segment.length(), input_file->Size());
+            if (end > segment.offset())
+            {
+                inputs.push_back({input_file.get(), segment.offset(), end});
+                chunkSize += end - segment.offset();
             }
+            input_files.push_back(move(input_file));
+        }
+        cout << "Map Task Received by Master for " << segments.size() << " Segments starting at " << segments[0].path() << " on Chunk Number: " << chunkNumber << " with Chunk Size: " << chunkSize << endl;
 
-            // Checking if 1024 is larger than the remaining chunk for Slave
-            bufferSize = ((1024 > chunkSize - totalBytesRead) ? chunkSize - totalBytesRead : 1024);
+        // Opening one output file on local disk for each reducer partition, reducers fetch them from here. The files
+        // hold record blocks, compressed with the codec the job asks for. The files are
+        // written under a name unique to this attempt and only renamed to their final name once the task has succeeded.
+        string map_num = to_string(chunkNumber);
+        vector<unique_ptr<OutputFile>> output_files;
+        vector<string> outputpaths;
+        for (int i = 0; i < numOfPartitions; i++)
+        {
+            string outputpath = MapOutputPath(workDirectory, chunkNumber, i);
+            outputpaths.push_back(outputpath);
+            unique_ptr<OutputFile> output_file = localStorage->OpenOutput(AttemptPath(outputpath, request->attempt()));
+            if (!output_file)
+            {
+                cout << "Failed to open output file " << outputpath << endl;
+                for (auto &file : output_files)
+                    file->Close();
+                DiscardAttempt(*localStorage, outputpaths, request->attempt());
+                return Status(grpc::StatusCode::FAILED_PRECONDITION, "Failed to open Output File");
+            }
+            output_files.push_back(move(output_file));
         }
+        cout << "Opened " << numOfPartitions << " output files successfully for Map: " << map_num << endl;
 
-        // Close files and disconnect from HDFS
-        hdfsCloseFile(fs, input_file);
-        hdfsCloseFile(fs, output_file);
-        hdfsDisconnect(fs);
+        // Dividing the bytes of the chunk evenly between the map threads, as if its segments were laid end to end. A
+        // thread's share may span several segments or a part of one. Every thread counts its words separately with its
+        // own share of the combiner budget and hands the counts to the shared output.
+        int64_t numOfRanges = max<int64_t>(1, min<int64_t>(mapPool.Size(), chunkSize / minRangeSize));
+        vector<vector<InputRange>> threadInputs(numOfRanges);
+        int64_t position = 0;
+        for (auto &input : inputs)
+        {
+            for (int64_t i = 0; i < numOfRanges; i++)
+            {
+                int64_t shareStart = chunkSize * i / numOfRanges;
+                int64_t shareEnd = chunkSize * (i + 1) / numOfRanges;
+                int64_t start = max(shareStart, position);
+                int64_t end = min(shareEnd, position + input.end - input.start);
+                if (start < end)
+                    threadInputs[i].push_back({input.file, input.start + start - position, input.start + end - position});
+            }
+            position += input.end - input.start;
+        }
+        MapOutput output(output_files, request->codec() == CODEC_ZLIB ? CODEC_ZLIB : CODEC_NONE, vector<string>(request->splitpoints().begin(), request->splitpoints().end()));
+        vector<future<bool>> rangeResults;
+        vector<TaskCounters> rangeCounters(numOfRanges); // Every thread counts into its own, merged once all are done
+        for (int64_t i = 0; i < numOfRanges; i++)
+        {
+            const vector<InputRange> *ranges = &threadInputs[i];
+            TaskCounters *threadCounters = &rangeCounters[i];
+            rangeResults.push_back(mapPool.Submit([ranges, readBufferSize, &delimiters, &output, combinerBudget, numOfRanges, threadCounters]()
+                                                  {
+                                                      Combiner combiner(output, combinerBudget / numOfRanges, *threadCounters);
+                                                      bool success = true;
+                                                      for (auto &range : *ranges)
+                                                          success = success && CountWords(*range.file, range.start, range.end, readBufferSize, delimiters, combiner, *threadCounters);
+                                                      combiner.Flush();
+                                                      threadCounters->peakMemory += combiner.PeakMemory();
+                                                      return success; }));
+        }
+        bool success = true;
+        for (auto &result : rangeResults)
+            success = result.get() && success;
+        for (auto &threadCounters : rangeCounters)
+            counters.Merge(threadCounters);
+        if (!success)
+        {
+            cout << "Failed to read input of Chunk Number " << chunkNumber << endl;
+            for (auto &file : output_files)
+                file->Close();
+            DiscardAttempt(*localStorage, outputpaths, request->attempt());
+            return Status(grpc::StatusCode::INTERNAL, "Failed to read Input File");
+        }
 
+        // Close files
+        PhaseTimer writeTimer(counters.writeNanos);
+        bool closed = true;
+        for (auto &file : output_files)
+            closed = file->Close() && closed;
+        if (output.Failed() || !closed)
+        {
+            DiscardAttempt(*localStorage, outputpaths, request->attempt());
+            return Status(grpc::StatusCode::INTERNAL, "Failed to write Output File");
+        }
+        Status commitStatus = CommitAttempt(context, *localStorage, outputpaths, request->attempt());
+        if (!commitStatus.ok())
+            return commitStatus;
+
+        response->set_address(address);
         cout << "Map Task Completed on Chunk number:" << chunkNumber << endl;
         return Status::OK;
     }
 
-    bool isMyKey(string word, string keyrange)
+    // Name under which one attempt of a task writes an output file before committing it
+    static string AttemptPath(const string &path, int64_t attempt)
     {
-        for (int i = 0; i < keyrange.size(); i++)
+        return path + ".attempt-" + to_string(attempt);
+    }
+
+    static void DiscardAttempt(Storage &storage, const vector<string> &paths, int64_t attempt)
+    {
+        for (auto &path : paths)
+            storage.Delete(AttemptPath(path, attempt));
+    }
+
+    // Moving the files of a finished attempt to their final names. An attempt the master has cancelled because another
+    // attempt of the same task finished first discards its files instead, so duplicates never overwrite each other
+    // half way.
+    static Status CommitAttempt(ServerContext *context, Storage &storage, const vector<string> &paths, int64_t attempt)
+    {
+        if (context->IsCancelled())
+        {
+            DiscardAttempt(storage, paths, attempt);
+            cout << "Attempt " << attempt << " was cancelled by Master, discarding its output" << endl;
+            return Status(grpc::StatusCode::CANCELLED, "Attempt cancelled");
+        }
+        for (auto &path : paths)
         {
-            if (word[0] == keyrange[i])
-                return true;
+            if (!storage.Rename(AttemptPath(path, attempt), path))
+            {
+                cout << "Failed to commit output file " << path << endl;
+                return Status(grpc::StatusCode::INTERNAL, "Failed to commit Output File");
+            }
         }
-        return false;
+        return Status::OK;
     }
 
     Status Reduce(ServerContext *context, const ReduceRequest *request, ReduceResponse *response) override
     {
-        string maplocation = request->maplocation();
-        int numofmaps = request->numofmaps();
-        string keyrange = request->keyrange();
+        auto started = chrono::steady_clock::now();
+        TaskCounters counters;
+        ++runningTasks;
+        Status status = RunReduce(context, request, response, counters);
+        --runningTasks;
+        RecordTask("Reduce", request->jobid(), request->partition(), request->attempt(), status.ok(), counters, NanosSince(started));
+        return status;
+    }
 
-        cout << "Reduce Task Received by Master on Map Location" << maplocation << " with " << numofmaps << " Maps " << endl;
-        map<string, int> wordcount;
+    // Appending the maps of a job that have completed after the ones already known, waiting at the master until at
+    // least one has. The wait ends early if the reduce attempt is cancelled.
+    Status WaitForMaps(ServerContext *serverContext, int64_t jobID, vector<MapLocation> &maps)
+    {
+        WaitForMapsRequest request;
+        WaitForMapsResponse response;
+        request.set_jobid(jobID);
+        request.set_after(maps.size());
+        unique_ptr<ClientContext> context = ClientContext::FromServerContext(*serverContext);
+        context->set_deadline(chrono::system_clock::now() + chrono::seconds(30));
+        Status status = masterStub->WaitForMaps(context.get(), request, &response);
+        maps.insert(maps.end(), response.maps().begin(), response.maps().end());
+        return status;
+    }
 
-        hdfsFS fs = hdfsConnect("default", 9870);
-        if (fs == NULL)
-        {
-            cout << "Error while connecting to HDFS..." << endl;
-        }
+    // Map output that is not there or cannot be read, fetching it again does not help
+    static bool IsMissing(const Status &status)
+    {
+        return status.error_code() == grpc::StatusCode::NOT_FOUND || status.error_code() == grpc::StatusCode::DATA_LOSS;
+    }
+
+    // A slave that could not be reached or was too busy for the fetch, which may well succeed a moment later
+    static bool IsTransient(const Status &status)
+    {
+        return status.error_code() == grpc::StatusCode::UNAVAILABLE || status.error_code() == grpc::StatusCode::RESOURCE_EXHAUSTED;
+    }
 
-        string outputfile = maplocation + "output-" + keyrange[0] + ".txt";
+    // Telling the master the output of a map could not be fetched, so it runs the map again and lists the new output
+    Status ReportLostMapOutput(ServerContext *serverContext, int64_t jobID, const MapLocation &location, const Status &fetchStatus)
+    {
+        ReportLostMapOutputRequest request;
+        ReportLostMapOutputResponse response;
+        request.set_jobid(jobID);
+        *request.mutable_location() = location;
+        request.set_error(fetchStatus.error_message());
+        unique_ptr<ClientContext> context = ClientContext::FromServerContext(*serverContext);
+        context->set_deadline(chrono::system_clock::now() + chrono::seconds(10));
+        return masterStub->ReportLostMapOutput(context.get(), request, &response);
+    }
+
+    Status RunReduce(ServerContext *context, const ReduceRequest *request, ReduceResponse *response, TaskCounters &counters)
+    {
+        string maplocation = request->maplocation();
+        int numofmaps = request->numofmaps();
+        int partition = request->partition();
+
+        cout << "Reduce Task Received by Master on Map Location" << maplocation << " with " << numofmaps << " Maps for Partition: " << partition << endl;
+        string outputDirectory = request->outputdirectory().empty() ? maplocation : request->outputdirectory();
+        string outputfile = outputDirectory + "output-" + to_string(partition) + ".txt";
+        // Counts beyond the memory budget are spilled to local disk as sorted runs under an attempt specific name
+        string runPrefix = maplocation + "reduce-" + to_string(partition) + ".attempt-" + to_string(request->attempt()) + "-run-";
+        ReduceCounts wordcount(request->memorybudget(), *localStorage, runPrefix, counters);
+        int64_t readBufferSize = request->readbuffersize() > 0 ? request->readbuffersize() : defaultReadBufferSize;
 
-        string mapprefix = "map-";
-        for (int i = 0; i < numofmaps; i++)
+        // Each map has kept the words of this partition in its own file on the slave that ran it, so only those files
+        // are fetched. A reducer started while maps are still running is told of the maps completed so far and asks
+        // the master for the others, adding the output of each map to the counts as soon as it has completed.
+        // Output that cannot be fetched is reported lost, the master maps it again and lists it once more.
+        vector<MapLocation> maps(request->maps().begin(), request->maps().end());
+        vector<bool> fetched(numofmaps, false);
+        int numFetched = 0;
+        set<string> failingAddresses; // Slaves the last fetch from failed, not retried until a fetch from them succeeds
+        for (size_t next = 0; numFetched < numofmaps;)
         {
-            string filename = maplocation + mapprefix + to_string(i) + ".txt";
-            hdfsFile input_file = hdfsOpenFile(fs, filename.c_str(), O_RDONLY, 0, 0, 0);
-            if (!input_file)
+            if (context->IsCancelled())
+                return Status(grpc::StatusCode::CANCELLED, "Attempt cancelled");
+            if (next == maps.size())
             {
-                cout << "Failed to open input file " << filename << endl;
-                return Status(grpc::StatusCode::FAILED_PRECONDITION, "Failed to open Input File");
+                Status waitStatus = WaitForMaps(context, request->jobid(), maps);
+                if (!waitStatus.ok())
+                {
+                    cout << "Failed to ask Master for completed Maps: " << waitStatus.error_message() << endl;
+                    return Status(grpc::StatusCode::UNAVAILABLE, "Failed to ask Master for completed Maps: " + waitStatus.error_message());
+                }
+                continue;
             }
-
-            int bytesRead;
-            char buffer[1024];
-            string word;
-            while ((bytesRead = hdfsRead(fs, input_file, buffer, 1024)) > 0)
+            const MapLocation &location = maps[next++];
+            if (location.split() < 0 || location.split() >= numofmaps || fetched[location.split()] || location.address().empty())
+                continue;
+            int64_t recordsRead = counters.recordsRead;
+            int retries = failingAddresses.count(location.address()) ? 0 : maxFetchRetries;
+            Status fetchStatus;
+            for (int retry = 0;; retry++)
             {
-                for (int i = 0; i < bytesRead; i++)
+                fetchStatus = FetchMapOutput(context, maplocation, location, partition, readBufferSize, wordcount, counters);
+                // Only a fetch that has not counted anything yet can be tried again
+                if (!IsTransient(fetchStatus) || retry == retries || counters.recordsRead != recordsRead || context->IsCancelled())
+                    break;
+                cout << "Failed to fetch output of Map " << location.chunknumber() << " from " << location.address() << ": " << fetchStatus.error_message() << ", trying again" << endl;
+                this_thread::sleep_for(fetchBackoff * (1 << retry));
+            }
+            if (!fetchStatus.ok())
+            {
+                cout << "Failed to fetch output of Map " << location.chunknumber() << " from " << location.address() << ": " << fetchStatus.error_message() << endl;
+                if (context->IsCancelled())
+                    return Status(grpc::StatusCode::CANCELLED, "Attempt cancelled");
+                failingAddresses.insert(location.address());
+                // Output that failed part way through is only reported if it is missing or corrupt, a stream that was cut
+                // off may well come through whole for the next attempt
+                bool counted = counters.recordsRead != recordsRead;
+                if (!counted || IsMissing(fetchStatus))
                 {
-                    if (buffer[i] == '\n')
-                    {
-                        if (!word.empty() && isMyKey(word, keyrange))
-                        {
-                            wordcount[word]++;
-                        }
-                        word.clear();
-                    }
-                    else
-                    {
-                        word += buffer[i];
-                    }
+                    Status reportStatus = ReportLostMapOutput(context, request->jobid(), location, fetchStatus);
+                    if (!reportStatus.ok())
+                        return Status(grpc::StatusCode::UNAVAILABLE, "Failed to report lost Map Output to Master: " + reportStatus.error_message());
                 }
+                // Nothing of it was counted yet, so the reducer can go on and take the output of the map run again
+                if (!counted)
+                    continue;
+                return Status(grpc::StatusCode::UNAVAILABLE, "Failed to fetch Map Output: " + fetchStatus.error_message());
             }
-            cout << "File Read: " << filename << endl;
-            hdfsCloseFile(fs, input_file);
+            failingAddresses.erase(location.address());
+            fetched[location.split()] = true;
+            ++numFetched;
+            if (wordcount.Failed())
+                return Status(grpc::StatusCode::INTERNAL, "Failed to spill Reduce Counts to local disk");
+            cout << "Fetched output of Map " << location.chunknumber() << " from " << location.address() << endl;
         }
 
-        hdfsFile output_file = hdfsOpenFile(fs, outputfile.c_str(), O_WRONLY | O_CREAT, 0, 0, 0);
+        counters.peakMemory += wordcount.PeakMemory();
+
+        PhaseTimer writeTimer(counters.writeNanos);
+        unique_ptr<OutputFile> output_file = storage->OpenOutput(AttemptPath(outputfile, request->attempt()));
         if (!output_file)
         {
             cout << "Failed to open output file " << outputfile << endl;
             return Status(grpc::StatusCode::FAILED_PRECONDITION, "Failed to open Output File");
         }
 
-        for (auto &word : wordcount)
+        // Words are only sorted once, when the counts are final, and streamed to the output while the top K are picked
+        string outputBuffer;
+        TopKWords topWords(request->topk());
+        bool merged = wordcount.Merge([&](string_view word, int64_t count)
+                                      {
+                                          topWords.Add(word, count);
+                                          outputBuffer.append(word.data(), word.size());
+                                          outputBuffer += ' ';
+                                          outputBuffer += to_string(count);
+                                          outputBuffer += '\n';
+                                          ++counters.recordsEmitted;
+                                          if (outputBuffer.size() >= 64 * 1024)
+                                          {
+                                              output_file->Write(outputBuffer.data(), outputBuffer.size());
+                                              counters.bytesWritten += outputBuffer.size();
+                                              outputBuffer.clear();
+                                          } });
+        output_file->Write(outputBuffer.data(), outputBuffer.size());
+        counters.bytesWritten += outputBuffer.size();
+
+        if (!merged)
+        {
+            cout << "Failed to merge spilled Reduce Counts" << endl;
+            output_file->Close();
+            DiscardAttempt(*storage, {outputfile}, request->attempt());
+            return Status(grpc::StatusCode::INTERNAL, "Failed to merge spilled Reduce Counts");
+        }
+        if (!output_file->Close())
         {
-            cout << word.first << " " << word.second << endl;
-            hdfsWrite(fs, output_file, word.first.c_str(), word.first.size());
-            hdfsWrite(fs, output_file, " ", 1);
-            hdfsWrite(fs, output_file, (to_string(word.second)).c_str(), to_string(word.second).size());
-            hdfsWrite(fs, output_file, "\n", 1);
+            cout << "Failed to write output file " << outputfile << endl;
+            DiscardAttempt(*storage, {outputfile}, request->attempt());
+            return Status(grpc::StatusCode::INTERNAL, "Failed to write Output File");
         }
+        Status commitStatus = CommitAttempt(context, *storage, {outputfile}, request->attempt());
+        if (!commitStatus.ok())
+            return commitStatus;
 
-        hdfsCloseFile(fs, output_file);
-        hdfsDisconnect(fs);
+        for (auto &word : topWords.Result())
+        {
+            WordCount *topWord = response->add_topwords();
+            topWord->set_word(word.first);
+            topWord->set_count(word.second);
+        }
 
         cout << "Reduce Task Completed Output Stored To: " << outputfile << endl;
         return Status::OK;
     }
 
+    // Streaming one partition of a map output this slave has produced to the reducer asking for it
+    Status FetchPartition(ServerContext *context, const FetchPartitionRequest *request, ServerWriter<PartitionChunk> *writer) override
+    {
+        string filename = MapOutputPath(request->maplocation(), request->chunknumber(), request->partition());
+        unique_ptr<InputFile> input_file = localStorage->OpenInput(filename);
+        if (!input_file)
+        {
+            cout << "Map Output " << filename << " requested by a reducer does not exist" << endl;
+            return Status(grpc::StatusCode::NOT_FOUND, "Map Output " + filename + " does not exist");
+        }
+        // Blocks are sent as they are stored, the reducer verifies and decompresses them
+        RecordBlockReader reader(*input_file, defaultReadBufferSize);
+        PartitionChunk chunk;
+        string block;
+        BlockHeader header;
+        while (reader.NextBlock(block, header))
+        {
+            chunk.mutable_data()->append(block);
+            if (chunk.data().size() < fetchChunkSize)
+                continue;
+            if (context->IsCancelled())
+                return Status(grpc::StatusCode::CANCELLED, "Fetch cancelled");
+            if (!writer->Write(chunk))
+                return Status(grpc::StatusCode::CANCELLED, "Reducer went away");
+            chunk.clear_data();
+        }
+        if (reader.Failed())
+            return Status(grpc::StatusCode::DATA_LOSS, "Failed to read Map Output " + filename);
+        if (!chunk.data().empty() && !writer->Write(chunk))
+            return Status(grpc::StatusCode::CANCELLED, "Reducer went away");
+        return Status::OK;
+    }
+
+    // Metrics of the tasks finished after the sequence number the master has already seen, of one job or of all jobs
+    Status GetMetrics(ServerContext *context, const GetMetricsRequest *request, GetMetricsResponse *response) override
+    {
+        rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0)
+            response->set_peakrss(usage.ru_maxrss * 1024); // Kilobytes on Linux
+        lock_guard<mutex> lock(metricsMutex);
+        for (auto &task : recentTasks)
+        {
+            if (task.sequence() > request->after() && (request->jobid() == 0 || task.jobid() == request->jobid()))
+                *response->add_tasks() = task;
+        }
+        for (int i = 0; i < DurationHistogram::numOfBuckets; i++)
+        {
+            response->add_mapdurations(mapDurations.Bucket(i));
+            response->add_reducedurations(reduceDurations.Bucket(i));
+        }
+        return Status::OK;
+    }
+
+    // Keeping the metrics of a finished task for GetMetrics, only the most recent tasks are kept
+    void RecordTask(const string &type, int64_t jobID, int64_t id, int64_t attempt, bool succeeded, const TaskCounters &counters, int64_t totalNanos)
+    {
+        TaskMetrics task;
+        task.set_type(type);
+        task.set_jobid(jobID);
+        task.set_id(id);
+        task.set_attempt(attempt);
+        task.set_succeeded(succeeded);
+        task.set_bytesread(counters.bytesRead);
+        task.set_recordsread(counters.recordsRead);
+        task.set_recordsemitted(counters.recordsEmitted);
+        task.set_byteswritten(counters.bytesWritten);
+        task.set_totalmicros(totalNanos / 1000);
+        task.set_readmicros(counters.readNanos / 1000);
+        task.set_tokenizemicros(counters.tokenizeNanos / 1000);
+        task.set_aggregatemicros(counters.aggregateNanos / 1000);
+        task.set_writemicros(counters.writeNanos / 1000);
+        task.set_fetchmicros(counters.fetchNanos / 1000);
+        task.set_peakmemory(counters.peakMemory);
+        bytesProcessed += counters.bytesRead;
+
+        lock_guard<mutex> lock(metricsMutex);
+        task.set_sequence(nextTaskSequence++);
+        (type == "Map" ? mapDurations : reduceDurations).Add(totalNanos / 1000000);
+        recentTasks.push_back(task);
+        if (recentTasks.size() > maxRecentTasks)
+            recentTasks.pop_front();
+    }
+
     void RegisterWithMaster(string addr)
     {
-        auto channel = grpc::CreateChannel("0.0.0.0:50056", grpc::InsecureChannelCredentials());
-        auto stub = MasterService::NewStub(channel);
         RegisterSlaveRequest request;
         RegisterSlaveResponse response;
         request.set_address(addr);
+        request.set_slots(taskSlots);
         ClientContext context;
-        auto status = stub->RegisterSlave(&context, request, &response);
+        auto status = masterStub->RegisterSlave(&context, request, &response);
         if (status.ok())
         {
-            cout << "The Slave has been registered with Master with Address: " << addr << endl;
+            cout << "The Slave has been registered with Master with Address: " << addr << " and " << taskSlots << " Task Slots" << endl;
         }
         else
         {
@@ -251,28 +961,80 @@ public:
             exit(1);
         }
     }
+
+    // Telling the master this slave is going away so it stops assigning tasks and drops its connection
+    void DeregisterWithMaster(string addr)
+    {
+        DeregisterSlaveRequest request;
+        DeregisterSlaveResponse response;
+        request.set_address(addr);
+        ClientContext context;
+        context.set_deadline(chrono::system_clock::now() + chrono::seconds(2));
+        auto status = masterStub->DeregisterSlave(&context, request, &response);
+        if (status.ok())
+            cout << "The Slave has been deregistered from Master" << endl;
+        else
+            cout << "Error while deregistering from Master: " << status.error_message() << endl;
+    }
 };
 
 int main(int argc, char **argv)
 {
     setenv("CLASSPATH", "/home/sabooh/hadoop-3.3.5/etc/hadoop:/home/sabooh/hadoop-3.3.5/share/hadoop/common/*:/home/sabooh/hadoop-3.3.5/share/hadoop/common/lib/*:/home/sabooh/hadoop-3.3.5/share/hadoop/hdfs/*:/home/sabooh/hadoop-3.3.5/share/hadoop/hdfs/lib/*:/home/sabooh/hadoop-3.3.5/share/hadoop/mapreduce/*:/home/sabooh/hadoop-3.3.5/share/hadoop/mapreduce/lib/*", 1);
+
+    // Blocking SIGINT and SIGTERM before any thread is started, so they are only received by the shutdown thread below
+    sigset_t shutdownSignals;
+    sigemptyset(&shutdownSignals);
+    sigaddset(&shutdownSignals, SIGINT);
+    sigaddset(&shutdownSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &shutdownSignals, nullptr);
+
     string port;
-    if (argc == 2)
+    if (argc >= 2)
         port = argv[1];
     else
     {
         cout << "Enter Port Number for this Slave: ";
         cin >> port;
     }
+    // Optional second argument selecting the storage backend, e.g. "local:/data" to run without HDFS
+    string storageSpec = argc >= 3 ? argv[2] : "hdfs";
+    unique_ptr<Storage> storage = Storage::Create(storageSpec);
+    if (!storage)
+    {
+        cout << "Unknown storage backend: " << storageSpec << endl;
+        return 1;
+    }
+    cout << "Using storage backend " << storage->Name() << endl;
+    // Optional third argument with the number of threads a map task is split across, defaults to the number of cores
+    int mapThreads = argc >= 4 ? stoi(argv[3]) : thread::hardware_concurrency();
+    // Optional fourth argument with the local directory map output is kept in until reducers have fetched it
+    string localDirectory = argc >= 5 ? argv[4] : "/tmp/mapreduce-slave-" + port;
+    unique_ptr<Storage> localStorage = Storage::Create("local:" + localDirectory);
+    cout << "Keeping map output in " << localDirectory << endl;
+    // Optional fifth argument with the number of tasks run at once, defaults to the number of cores. The map threads
+    // are shared by all tasks.
+    int taskSlots = argc >= 6 ? stoi(argv[5]) : max(1u, thread::hardware_concurrency());
     string server_address("0.0.0.0:" + port);
-    Slave service;
+    Slave service(server_address, move(storage), move(localStorage), mapThreads, taskSlots);
 
+    // The server has no thread quota. Reducers across the cluster may all fetch from this slave at once, and a
+    // rejected heartbeat would get a healthy slave taken for lost. Tasks are bounded by the slots the master keeps to.
     grpc::ServerBuilder builder;
     builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
     builder.RegisterService(&service);
     unique_ptr<grpc::Server> server(builder.BuildAndStart());
     service.RegisterWithMaster(server_address);
     cout << "Server listening on " << server_address << endl;
+
+    // Deregistering from the master and stopping the server on SIGINT / SIGTERM
+    thread shutdown_thread([&]()
+                           {
+                               int signal;
+                               sigwait(&shutdownSignals, &signal);
+                               service.DeregisterWithMaster(server_address);
+                               server->Shutdown(); });
     server->Wait();
+    shutdown_thread.join();
     return 0;
 }
\ No newline at end of file
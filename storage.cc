@@ -0,0 +1,503 @@
+#include "storage.h"
+
+#include <hdfs.h>
+
+#include <iostream>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+// ---------------------------------------------------------------- Prefetching reader
+
+PrefetchReader::PrefetchReader(InputFile &file, int64_t start, int64_t end, int64_t bufferSize)
+    : file(file), end(min(end, file.Size())), bufferSize(max<int64_t>(bufferSize, 4096)), position(start), readPosition(start),
+      mapped(false), failed(false), current(0), data(nullptr), dataLength(0), dataConsumed(0), prefetchLength(0)
+{
+    if (start < this->end && file.Map(start, this->end - start))
+        mapped = true;
+    else
+        StartPrefetch();
+}
+
+PrefetchReader::~PrefetchReader()
+{
+    // The background read writes into a buffer of this reader, so it has to finish first
+    if (prefetch.valid())
+        prefetch.wait();
+}
+
+void PrefetchReader::StartPrefetch()
+{
+    if (readPosition >= end)
+        return;
+    int64_t length = min(bufferSize, end - readPosition);
+    vector<char> &buffer = buffers[1 - current];
+    buffer.resize(bufferSize);
+    InputFile *input = &file;
+    char *destination = buffer.data();
+    int64_t offset = readPosition;
+    prefetch = async(launch::async, [input, offset, destination, length]()
+                     { return input->Read(offset, destination, length); });
+    prefetchLength = length;
+    readPosition += length;
+}
+
+// Making the next buffer current, false at the end of the range or on a read error
+bool PrefetchReader::Advance()
+{
+    if (failed || position >= end)
+        return false;
+    if (mapped)
+    {
+        dataLength = min(bufferSize, end - position);
+        data = file.Map(position, dataLength);
+        dataConsumed = 0;
+        return data != nullptr || !(failed = true);
+    }
+    if (!prefetch.valid())
+        return false;
+    int64_t bytesRead = prefetch.get();
+    if (bytesRead <= 0)
+    {
+        failed = true;
+        return false;
+    }
+    current = 1 - current;
+    data = buffers[current].data();
+    dataLength = bytesRead;
+    dataConsumed = 0;
+    // A short read means the file ended early, nothing further is prefetched
+    if (bytesRead < prefetchLength)
+        end = readPosition = readPosition - prefetchLength + bytesRead;
+    else
+        StartPrefetch();
+    return true;
+}
+
+bool PrefetchReader::Next(const char *&buffer, int64_t &length)
+{
+    if (dataConsumed == dataLength && !Advance())
+        return false;
+    buffer = data + dataConsumed;
+    length = dataLength - dataConsumed;
+    position += length;
+    dataConsumed = dataLength;
+    return true;
+}
+
+int64_t PrefetchReader::Read(char *destination, int64_t length)
+{
+    int64_t total = 0;
+    while (total < length)
+    {
+        if (dataConsumed == dataLength && !Advance())
+            break;
+        int64_t copied = min(length - total, dataLength - dataConsumed);
+        memcpy(destination + total, data + dataConsumed, copied);
+        dataConsumed += copied;
+        position += copied;
+        total += copied;
+    }
+    return total;
+}
+
+// ---------------------------------------------------------------- HDFS
+
+class HdfsInputFile : public InputFile
+{
+    hdfsFS fs;
+    hdfsFile file;
+    int64_t size;
+
+public:
+    HdfsInputFile(hdfsFS fs, hdfsFile file, int64_t size) : fs(fs), file(file), size(size) {}
+    ~HdfsInputFile() { hdfsCloseFile(fs, file); }
+
+    int64_t Size() override { return size; }
+
+    int64_t Read(int64_t offset, char *buffer, int64_t length) override
+    {
+        // hdfsRead may return less than asked for, so reading until length is satisfied or the file ends
+        int64_t total = 0;
+        while (total < length && offset + total < size)
+        {
+            tSize bytesRead = hdfsPread(fs, file, offset + total, buffer + total, length - total);
+            if (bytesRead < 0)
+                return -1;
+            if (bytesRead == 0)
+                break;
+            total += bytesRead;
+        }
+        return total;
+    }
+};
+
+class HdfsOutputFile : public OutputFile
+{
+    hdfsFS fs;
+    hdfsFile file;
+    bool failed;
+
+public:
+    HdfsOutputFile(hdfsFS fs, hdfsFile file) : fs(fs), file(file), failed(false) {}
+    ~HdfsOutputFile() { Close(); }
+
+    bool Write(const char *data, int64_t length) override
+    {
+        if (!file)
+            return false;
+        if (hdfsWrite(fs, file, data, length) != length)
+            failed = true;
+        return !failed;
+    }
+
+    bool Close() override
+    {
+        if (file)
+        {
+            if (hdfsCloseFile(fs, file) != 0)
+                failed = true;
+            file = nullptr;
+        }
+        return !failed;
+    }
+};
+
+// Keeps one connection to the namenode for the lifetime of the process, hdfsFS handles are safe to share by threads
+class HdfsStorage : public Storage
+{
+    string namenode;
+    tPort port;
+    hdfsFS fs;
+    mutex connectMutex;
+
+    // Connecting lazily and again after a failed attempt, so a namenode that comes up later is picked up
+    hdfsFS Connection()
+    {
+        lock_guard<mutex> lock(connectMutex);
+        if (fs == NULL)
+        {
+            fs = hdfsConnect(namenode.c_str(), port);
+            if (fs == NULL)
+                cout << "Error while connecting to HDFS..." << endl;
+        }
+        return fs;
+    }
+
+public:
+    HdfsStorage(string namenode, tPort port) : namenode(namenode), port(port), fs(NULL) {}
+    ~HdfsStorage()
+    {
+        if (fs != NULL)
+            hdfsDisconnect(fs);
+    }
+
+    string Name() override { return "hdfs:" + namenode + ":" + to_string(port); }
+
+    unique_ptr<InputFile> OpenInput(const string &path) override
+    {
+        hdfsFS fs = Connection();
+        if (fs == NULL)
+            return nullptr;
+        hdfsFileInfo *fileInfo = hdfsGetPathInfo(fs, path.c_str());
+        if (!fileInfo)
+            return nullptr;
+        int64_t size = fileInfo->mSize;
+        hdfsFreeFileInfo(fileInfo, 1);
+        hdfsFile file = hdfsOpenFile(fs, path.c_str(), O_RDONLY, 0, 0, 0);
+        if (!file)
+            return nullptr;
+        return unique_ptr<InputFile>(new HdfsInputFile(fs, file, size));
+    }
+
+    unique_ptr<OutputFile> OpenOutput(const string &path) override
+    {
+        hdfsFS fs = Connection();
+        if (fs == NULL)
+            return nullptr;
+        hdfsFile file = hdfsOpenFile(fs, path.c_str(), O_WRONLY | O_CREAT, 0, 0, 0);
+        if (!file)
+            return nullptr;
+        return unique_ptr<OutputFile>(new HdfsOutputFile(fs, file));
+    }
+
+    bool GetFileInfo(const string &path, FileInfo &info) override
+    {
+        hdfsFS fs = Connection();
+        if (fs == NULL)
+            return false;
+        hdfsFileInfo *fileInfo = hdfsGetPathInfo(fs, path.c_str());
+        if (!fileInfo)
+            return false;
+        info.path = path;
+        info.size = fileInfo->mSize;
+        info.isDirectory = fileInfo->mKind == kObjectKindDirectory;
+        info.blockSize = fileInfo->mBlockSize;
+        info.modificationTime = (int64_t)fileInfo->mLastMod * 1000000000;
+        hdfsFreeFileInfo(fileInfo, 1);
+        return true;
+    }
+
+    bool ListDirectory(const string &path, vector<FileInfo> &entries) override
+    {
+        hdfsFS fs = Connection();
+        if (fs == NULL)
+            return false;
+        int numEntries = 0;
+        errno = 0;
+        hdfsFileInfo *fileInfo = hdfsListDirectory(fs, path.c_str(), &numEntries);
+        // An empty directory is listed as NULL with errno left at 0
+        if (!fileInfo)
+            return errno == 0;
+        string directory = !path.empty() && path.back() == '/' ? path : path + "/";
+        for (int i = 0; i < numEntries; i++)
+        {
+            // Names come back as full URIs (hdfs://namenode:port/path), only the last component is kept
+            string name = fileInfo[i].mName;
+            FileInfo info;
+            info.path = directory + name.substr(name.rfind('/') + 1);
+            info.size = fileInfo[i].mSize;
+            info.isDirectory = fileInfo[i].mKind == kObjectKindDirectory;
+            info.blockSize = fileInfo[i].mBlockSize;
+            info.modificationTime = (int64_t)fileInfo[i].mLastMod * 1000000000;
+            entries.push_back(info);
+        }
+        hdfsFreeFileInfo(fileInfo, numEntries);
+        return true;
+    }
+
+    bool Rename(const string &from, const string &to) override
+    {
+        hdfsFS fs = Connection();
+        if (fs == NULL)
+            return false;
+        if (hdfsRename(fs, from.c_str(), to.c_str()) == 0)
+            return true;
+        // HDFS refuses to rename onto an existing file, so the old file is removed first
+        if (hdfsExists(fs, to.c_str()) == 0 && hdfsDelete(fs, to.c_str(), 0) == 0)
+            return hdfsRename(fs, from.c_str(), to.c_str()) == 0;
+        return false;
+    }
+
+    bool Delete(const string &path) override
+    {
+        hdfsFS fs = Connection();
+        if (fs == NULL)
+            return false;
+        return hdfsDelete(fs, path.c_str(), 1) == 0;
+    }
+};
+
+// ---------------------------------------------------------------- Local filesystem
+
+class LocalInputFile : public InputFile
+{
+    int fd;
+    int64_t size;
+    once_flag mapOnce;
+    char *mapping;
+
+public:
+    LocalInputFile(int fd, int64_t size) : fd(fd), size(size), mapping(nullptr) {}
+    ~LocalInputFile()
+    {
+        if (mapping)
+            munmap(mapping, size);
+        close(fd);
+    }
+
+    int64_t Size() override { return size; }
+
+    int64_t Read(int64_t offset, char *buffer, int64_t length) override
+    {
+        int64_t total = 0;
+        while (total < length)
+        {
+            ssize_t bytesRead = pread(fd, buffer + total, length - total, offset + total);
+            if (bytesRead < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            if (bytesRead == 0)
+                break;
+            total += bytesRead;
+        }
+        return total;
+    }
+
+    // The whole file is mapped read-only on first use and shared by every caller until the file is closed
+    const char *Map(int64_t offset, int64_t length) override
+    {
+        if (size == 0 || offset < 0 || offset + length > size)
+            return nullptr;
+        call_once(mapOnce, [this]()
+                  {
+                      void *address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                      if (address != MAP_FAILED)
+                      {
+                          madvise(address, size, MADV_SEQUENTIAL);
+                          mapping = static_cast<char *>(address);
+                      } });
+        return mapping ? mapping + offset : nullptr;
+    }
+};
+
+class LocalOutputFile : public OutputFile
+{
+    int fd;
+    bool failed;
+
+public:
+    LocalOutputFile(int fd) : fd(fd), failed(false) {}
+    ~LocalOutputFile() { Close(); }
+
+    bool Write(const char *data, int64_t length) override
+    {
+        while (length > 0 && !failed)
+        {
+            ssize_t written = write(fd, data, length);
+            if (written < 0)
+            {
+                if (errno != EINTR)
+                    failed = true;
+                continue;
+            }
+            data += written;
+            length -= written;
+        }
+        return !failed;
+    }
+
+    bool Close() override
+    {
+        if (fd >= 0)
+        {
+            if (close(fd) != 0)
+                failed = true;
+            fd = -1;
+        }
+        return !failed;
+    }
+};
+
+class LocalStorage : public Storage
+{
+    string root;
+
+    string Resolve(const string &path) { return root + path; }
+
+    // Creating the missing parent directories of a file like HDFS does on create
+    static void CreateParentDirectories(const string &path)
+    {
+        for (size_t slash = path.find('/', 1); slash != string::npos; slash = path.find('/', slash + 1))
+            mkdir(path.substr(0, slash).c_str(), 0755);
+    }
+
+public:
+    LocalStorage(string root) : root(root)
+    {
+        while (this->root.size() > 1 && this->root.back() == '/')
+            this->root.pop_back();
+    }
+
+    string Name() override { return "local:" + root; }
+
+    unique_ptr<InputFile> OpenInput(const string &path) override
+    {
+        int fd = open(Resolve(path).c_str(), O_RDONLY);
+        if (fd < 0)
+            return nullptr;
+        struct stat fileStat;
+        if (fstat(fd, &fileStat) != 0)
+        {
+            close(fd);
+            return nullptr;
+        }
+        return unique_ptr<InputFile>(new LocalInputFile(fd, fileStat.st_size));
+    }
+
+    unique_ptr<OutputFile> OpenOutput(const string &path) override
+    {
+        string resolved = Resolve(path);
+        CreateParentDirectories(resolved);
+        int fd = open(resolved.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return nullptr;
+        return unique_ptr<OutputFile>(new LocalOutputFile(fd));
+    }
+
+    bool GetFileInfo(const string &path, FileInfo &info) override
+    {
+        struct stat fileStat;
+        if (stat(Resolve(path).c_str(), &fileStat) != 0)
+            return false;
+        info.path = path;
+        info.size = fileStat.st_size;
+        info.isDirectory = S_ISDIR(fileStat.st_mode);
+        info.blockSize = 0;
+        info.modificationTime = (int64_t)fileStat.st_mtim.tv_sec * 1000000000 + fileStat.st_mtim.tv_nsec;
+        return true;
+    }
+
+    bool ListDirectory(const string &path, vector<FileInfo> &entries) override
+    {
+        DIR *dir = opendir(Resolve(path).c_str());
+        if (!dir)
+            return false;
+        string directory = !path.empty() && path.back() == '/' ? path : path + "/";
+        while (dirent *entry = readdir(dir))
+        {
+            string name = entry->d_name;
+            FileInfo info;
+            if (name == "." || name == ".." || !GetFileInfo(directory + name, info))
+                continue;
+            entries.push_back(info);
+        }
+        closedir(dir);
+        return true;
+    }
+
+    bool Rename(const string &from, const string &to) override
+    {
+        return rename(Resolve(from).c_str(), Resolve(to).c_str()) == 0;
+    }
+
+    bool Delete(const string &path) override
+    {
+        return remove(Resolve(path).c_str()) == 0;
+    }
+};
+
+unique_ptr<Storage> Storage::Create(const string &spec)
+{
+    if (spec == "hdfs")
+        return unique_ptr<Storage>(new HdfsStorage("default", 9870));
+    if (spec.compare(0, 5, "hdfs:") == 0)
+    {
+        size_t colon = spec.rfind(':');
+        if (colon <= 5)
+            return nullptr;
+        string port = spec.substr(colon + 1);
+        char *portEnd;
+        errno = 0;
+        long portNumber = strtol(port.c_str(), &portEnd, 10);
+        if (port.empty() || *portEnd != '\0' || errno != 0 || portNumber <= 0 || portNumber > 65535)
+            return nullptr;
+        return unique_ptr<Storage>(new HdfsStorage(spec.substr(5, colon - 5), portNumber));
+    }
+    if (spec.compare(0, 6, "local:") == 0 && spec.size() > 6)
+        return unique_ptr<Storage>(new LocalStorage(spec.substr(6)));
+    return nullptr;
+}
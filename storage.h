@@ -0,0 +1,128 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Random access reader over one file of a storage backend. Reads are positional so one file can be shared by threads.
+class InputFile
+{
+public:
+    virtual ~InputFile() {}
+
+    virtual int64_t Size() = 0;
+
+    // Reading up to length bytes starting at offset into buffer. Returns the bytes read, 0 at end of file and -1 on error
+    virtual int64_t Read(int64_t offset, char *buffer, int64_t length) = 0;
+
+    // Zero-copy access to [offset, offset + length) if the backend can map the file into memory, nullptr otherwise
+    virtual const char *Map(int64_t offset, int64_t length) { return nullptr; }
+};
+
+// Sequential reader of a byte range of an InputFile in large buffers. While the caller works on one buffer the next
+// one is read in the background, so the caller rarely waits for the storage. Backends that can map the file hand out
+// views of the mapping instead and nothing is copied.
+class PrefetchReader
+{
+public:
+    PrefetchReader(InputFile &file, int64_t start, int64_t end, int64_t bufferSize);
+    ~PrefetchReader();
+
+    // The next buffer of the range, false at the end of the range or on a read error. The buffer stays valid until
+    // the next call.
+    bool Next(const char *&data, int64_t &length);
+
+    // Copying the next length bytes of the range to destination, across buffers if needed. Returns the bytes copied,
+    // less than length at the end of the range or on a read error.
+    int64_t Read(char *destination, int64_t length);
+
+    // Offset in the file of the next byte Next or Read returns
+    int64_t Position() const { return position; }
+
+    // Offset in the file the range ends at
+    int64_t End() const { return end; }
+
+    bool Failed() const { return failed; }
+
+    // Bytes allocated for the buffers, 0 if the file is mapped
+    int64_t BufferMemory() const { return buffers[0].capacity() + buffers[1].capacity(); }
+
+private:
+    InputFile &file;
+    int64_t end;
+    int64_t bufferSize;
+    int64_t position;     // File offset of the first byte of the current buffer not yet consumed
+    int64_t readPosition; // File offset of the first byte not yet read or prefetched
+    bool mapped;
+    bool failed;
+    std::vector<char> buffers[2];
+    int current; // Index of the buffer being consumed, the other one is being prefetched
+    const char *data;
+    int64_t dataLength;
+    int64_t dataConsumed;
+    std::future<int64_t> prefetch;
+    int64_t prefetchLength;
+
+    void StartPrefetch();
+    bool Advance();
+};
+
+// Sequential writer creating (or truncating) one file of a storage backend
+class OutputFile
+{
+public:
+    virtual ~OutputFile() {}
+
+    virtual bool Write(const char *data, int64_t length) = 0;
+
+    // Flushing and closing the file, returns false if any write since opening has failed
+    virtual bool Close() = 0;
+};
+
+struct FileInfo
+{
+    std::string path;
+    int64_t size;
+    bool isDirectory;
+    int64_t blockSize; // Block size of the file in the backend, 0 if the backend has no blocks
+    int64_t modificationTime; // Of the last change to the file in nanoseconds since the epoch, at the resolution of the backend
+};
+
+// Filesystem used for input, intermediate and output files. Paths are absolute ("/files/US_AirLines.txt") and are
+// resolved by each backend, so master and slaves can run against HDFS or a local / NFS mounted directory alike.
+class Storage
+{
+public:
+    virtual ~Storage() {}
+
+    virtual std::string Name() = 0;
+
+    // Returns nullptr if the file can not be opened
+    virtual std::unique_ptr<InputFile> OpenInput(const std::string &path) = 0;
+    virtual std::unique_ptr<OutputFile> OpenOutput(const std::string &path) = 0;
+
+    virtual bool GetFileInfo(const std::string &path, FileInfo &info) = 0;
+
+    // Entries of a directory with their paths below it, in no particular order. Returns false if the directory can
+    // not be listed.
+    virtual bool ListDirectory(const std::string &path, std::vector<FileInfo> &entries) = 0;
+
+    // Moving a file to a new path, replacing an existing file there. Used to commit task output written under a
+    // temporary name, so readers never see a partially written file.
+    virtual bool Rename(const std::string &from, const std::string &to) = 0;
+
+    // Deleting a file or a directory. HDFS deletes a directory with its contents, the local backend only an empty one.
+    virtual bool Delete(const std::string &path) = 0;
+
+    // Creating a backend from a command line specification:
+    //   hdfs                      libhdfs connected to the default namenode
+    //   hdfs:<namenode>:<port>    libhdfs connected to the given namenode
+    //   local:<root directory>    POSIX filesystem with all paths resolved below the root directory
+    // Returns nullptr for an unknown or malformed specification, such as a port that is not a number
+    static std::unique_ptr<Storage> Create(const std::string &spec);
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef TASK_METRICS_H
+#define TASK_METRICS_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+// Counters of one thread of a map or reduce task. Every thread owns its counters, so they are plain integers updated
+// without locks or atomics and are only added up with Merge once the threads of a task have finished. Times are
+// taken around whole buffers, blocks and batches of words, never around single words, so reading the clock stays
+// cheap enough for the counters to be left on in production.
+struct TaskCounters
+{
+    int64_t bytesRead = 0;      // Input of a map task, compressed map output fetched by a reduce task
+    int64_t recordsRead = 0;    // Words tokenized by a map task, records fetched by a reduce task
+    int64_t recordsEmitted = 0; // Records of map output, or words of the final output
+    int64_t bytesWritten = 0;
+    int64_t readNanos = 0;      // Waiting for input, reading ahead hides the rest of the reading
+    int64_t tokenizeNanos = 0;
+    int64_t aggregateNanos = 0;
+    int64_t writeNanos = 0;     // Encoding and writing output, spills and commits included
+    int64_t fetchNanos = 0;     // Shuffle of a reduce task, reading local map output or streaming it from other slaves
+    int64_t peakMemory = 0;     // Bytes of read buffers and aggregation tables at their largest
+
+    void Merge(const TaskCounters &other)
+    {
+        bytesRead += other.bytesRead;
+        recordsRead += other.recordsRead;
+        recordsEmitted += other.recordsEmitted;
+        bytesWritten += other.bytesWritten;
+        readNanos += other.readNanos;
+        tokenizeNanos += other.tokenizeNanos;
+        aggregateNanos += other.aggregateNanos;
+        writeNanos += other.writeNanos;
+        fetchNanos += other.fetchNanos;
+        // Threads of a task run at the same time, so their peaks add up
+        peakMemory += other.peakMemory;
+    }
+
+    void UpdatePeakMemory(int64_t bytes) { peakMemory = std::max(peakMemory, bytes); }
+};
+
+inline int64_t NanosSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Adding the time from construction to destruction to a counter
+class PhaseTimer
+{
+    int64_t &nanos;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    PhaseTimer(int64_t &nanos) : nanos(nanos), start(std::chrono::steady_clock::now()) {}
+    ~PhaseTimer() { nanos += NanosSince(start); }
+};
+
+// Task durations in power of two buckets, bucket i counting durations of less than 2^i milliseconds. Fixed size so
+// recording a task is a single increment.
+class DurationHistogram
+{
+public:
+    static const int numOfBuckets = 24;
+
+    DurationHistogram() : buckets() {}
+
+    void Add(int64_t millis)
+    {
+        int bucket = 0;
+        while (bucket < numOfBuckets - 1 && millis >= (int64_t(1) << bucket))
+            ++bucket;
+        ++buckets[bucket];
+    }
+
+    int64_t Bucket(int i) const { return buckets[i]; }
+
+private:
+    int64_t buckets[numOfBuckets];
+};
+
+#endif
@@ -0,0 +1,480 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "record_block.h"
+#include "storage.h"
+#include "tokenizer.h"
+#include "wordcount.h"
+#include "wordcount_table.h"
+
+using namespace std;
+
+// Differential tests of the fast paths against the simple implementations they replace, run on random input with a
+// fixed seed. Every failed check is printed and the exit code is 1 if there was any.
+
+static int failures = 0;
+
+static void Check(bool condition, const string &what)
+{
+    if (condition)
+        return;
+    cout << "FAILED: " << what << endl;
+    ++failures;
+}
+
+// Random bytes, most of them drawn from the given delimiters so words and runs of delimiters of every length come up
+static string RandomBuffer(mt19937 &random, size_t length, const string &delimiters)
+{
+    string buffer(length, '\0');
+    for (auto &c : buffer)
+    {
+        if (!delimiters.empty() && random() % 3 == 0)
+            c = delimiters[random() % delimiters.size()];
+        else
+            c = char(random() % 256);
+    }
+    return buffer;
+}
+
+// The SSE2 and AVX2 scanners of every delimiter set give the same offsets as the scalar one, for every alignment of
+// the buffer and every tail length after the last full vector
+static void TestDelimiterScanners()
+{
+    vector<string> sets = {
+        DelimiterSet::whitespace,
+        string(DelimiterSet::whitespace) + DelimiterSet::punctuation,
+        ",",
+        "",
+        "a0Z",
+        string("\0\x7f", 2),
+        "\x80\xff ",   // Bytes above 0x7f have no nibble entry, AVX2 is not used for them
+        " \t\n,.;:!?", // More delimiters than SSE2 compares one at a time
+    };
+    const char *names[] = {"BEST", "SCALAR", "SSE2", "AVX2"};
+    mt19937 random(2024);
+    for (auto &delimiters : sets)
+    {
+        DelimiterSet scalar(delimiters, DelimiterSet::SCALAR);
+        for (auto implementation : {DelimiterSet::SSE2, DelimiterSet::AVX2, DelimiterSet::BEST})
+        {
+            DelimiterSet scanner(delimiters, implementation);
+            string name = string(names[implementation]) + " with " + to_string(delimiters.size()) + " delimiters";
+            for (int round = 0; round < 10; round++)
+            {
+                string buffer = RandomBuffer(random, 64 + 3 * 32, delimiters);
+                for (size_t offset = 0; offset < 64; offset++)
+                {
+                    for (size_t length = 0; offset + length <= buffer.size(); length++)
+                    {
+                        const char *data = buffer.data() + offset;
+                        Check(scanner.FindDelimiter(data, length) == scalar.FindDelimiter(data, length),
+                              "FindDelimiter of " + name + " at offset " + to_string(offset) + " length " + to_string(length));
+                        Check(scanner.FindNonDelimiter(data, length) == scalar.FindNonDelimiter(data, length),
+                              "FindNonDelimiter of " + name + " at offset " + to_string(offset) + " length " + to_string(length));
+                    }
+                }
+                if (failures)
+                    return;
+            }
+        }
+    }
+}
+
+// WordCountTable counts the same as a std::map through several doublings of its slots and after being cleared. The
+// words include the empty word, words with any byte and words longer than an arena block.
+static void TestWordCountTable()
+{
+    mt19937 random(2025);
+    vector<string> vocabulary = {"", string(1, '\0'), string(100 * 1024, 'x')};
+    for (int i = 0; i < 20000; i++)
+        vocabulary.push_back(RandomBuffer(random, random() % 24, ""));
+    WordCountTable table;
+    for (int round = 0; round < 3; round++)
+    {
+        map<string, int64_t> expected;
+        for (int i = 0; i < 200000; i++)
+        {
+            // Mostly words of a small part of the vocabulary, so words repeat often as well as once only
+            const string &word = vocabulary[random() % 8 ? random() % 500 : random() % vocabulary.size()];
+            int64_t count = random() % 4 ? 1 : int64_t(random() % 1000000) * 1000;
+            table.Add(word, count);
+            expected[word] += count;
+        }
+        string name = "WordCountTable round " + to_string(round);
+        Check(table.Size() == expected.size(), name + " has " + to_string(table.Size()) + " words instead of " + to_string(expected.size()));
+        auto sorted = table.Sorted();
+        Check(sorted.size() == expected.size() && equal(sorted.begin(), sorted.end(), expected.begin(), [](const pair<string_view, int64_t> &a, const pair<const string, int64_t> &b)
+                                                         { return a.first == b.first && a.second == b.second; }),
+              name + " sorted words differ");
+        map<string, int64_t> visited;
+        table.ForEach([&visited](string_view word, int64_t count)
+                      { visited[string(word)] += count; });
+        Check(visited == expected, name + " ForEach words differ");
+        table.Clear();
+        Check(table.Size() == 0 && table.Sorted().empty(), name + " is not empty once cleared");
+    }
+}
+
+// File of the storage held in memory, either read into buffers or mapped like a local file
+class MemoryInputFile : public InputFile
+{
+    string data;
+    bool mapped;
+
+public:
+    MemoryInputFile(const string &data, bool mapped = false) : data(data), mapped(mapped) {}
+
+    int64_t Size() override { return data.size(); }
+
+    const char *Map(int64_t offset, int64_t length) override { return mapped ? data.data() + offset : nullptr; }
+
+    int64_t Read(int64_t offset, char *buffer, int64_t length) override
+    {
+        length = max<int64_t>(0, min<int64_t>(length, data.size() - offset));
+        memcpy(buffer, data.data() + offset, length);
+        return length;
+    }
+};
+
+typedef vector<pair<string, int64_t>> Records;
+
+// Records of the whole blocks at the start of blocks, false if DecodeBlocks finds a corrupt block or less than all of
+// blocks is whole blocks
+static bool DecodeAll(const string &blocks, Records &records)
+{
+    string scratch;
+    records.clear();
+    return DecodeBlocks(blocks.data(), blocks.size(), scratch, [&records](string_view word, int64_t count)
+                        { records.emplace_back(word, count); }) == int64_t(blocks.size());
+}
+
+// Records of blocks read through RecordBlockReader with a buffer of bufferSize bytes, false if the reader failed
+static bool ReadAll(const string &blocks, int64_t bufferSize, Records &records)
+{
+    MemoryInputFile file(blocks);
+    RecordBlockReader reader(file, bufferSize);
+    records.clear();
+    string_view word;
+    int64_t count;
+    while (reader.Next(word, count))
+        records.emplace_back(word, count);
+    return !reader.Failed();
+}
+
+// Blocks written with either codec decode to the records written, through DecodeBlocks and through RecordBlockReader
+// with buffers smaller and larger than a block. Damaged blocks are rejected rather than decoded to other records:
+// flipped bits, every cut off length and headers claiming huge lengths.
+static void TestRecordBlocks()
+{
+    mt19937 random(2026);
+    for (auto codec : {CODEC_NONE, CODEC_ZLIB})
+    {
+        string name = codec == CODEC_ZLIB ? "zlib blocks" : "uncompressed blocks";
+        Records written;
+        string blocks;
+        RecordBlockBuilder builder;
+        for (int i = 0; i < 5000; i++)
+        {
+            // Repetitive words so zlib compresses most blocks, and random ones it leaves as they are
+            string word = random() % 2 ? string(random() % 16, 'a' + random() % 4) : RandomBuffer(random, random() % 300, "");
+            int64_t count = random() % 3 ? random() % 100 : int64_t(random()) << 31;
+            builder.Add(word, count);
+            written.emplace_back(word, count);
+            if (random() % 200 == 0)
+                builder.Finish(codec, blocks);
+        }
+        builder.Finish(codec, blocks);
+        builder.Finish(codec, blocks); // A block without records
+
+        Records records;
+        Check(DecodeAll(blocks, records) && records == written, name + " decode to other records");
+        for (int64_t bufferSize : {7, 4096, 1 << 20})
+            Check(ReadAll(blocks, bufferSize, records) && records == written, name + " read with a buffer of " + to_string(bufferSize) + " differ");
+
+        // The 3 reserved bytes of a header are not read, any other bit flipped in the header of the first block or in
+        // a sample of its payload bytes is noticed
+        BlockHeader header;
+        ReadBlockHeader(blocks.data(), blocks.size(), header);
+        string firstBlock = blocks.substr(0, BlockHeader::size + header.storedLength);
+        vector<size_t> positions;
+        for (size_t i = 0; i < BlockHeader::size; i++)
+        {
+            if (i < 5 || i >= 8)
+                positions.push_back(i);
+        }
+        for (int i = 0; i < 64; i++)
+            positions.push_back(BlockHeader::size + random() % header.storedLength);
+        for (size_t i : positions)
+        {
+            for (int bit = 0; bit < 8; bit++)
+            {
+                string damaged = firstBlock;
+                damaged[i] ^= 1 << bit;
+                string where = " with bit " + to_string(bit) + " of byte " + to_string(i) + " flipped";
+                Check(!DecodeAll(damaged, records), name + where + " decode");
+                Check(!ReadAll(damaged, 4096, records), name + where + " are read");
+            }
+        }
+        for (size_t length = 1; length < firstBlock.size(); length++)
+        {
+            string cut = firstBlock.substr(0, length);
+            Check(!DecodeAll(cut, records) && records.empty(), name + " cut off at " + to_string(length) + " decode");
+            Check(!ReadAll(cut, 4096, records), name + " cut off at " + to_string(length) + " are read");
+        }
+        for (size_t field : {12, 16})
+        {
+            string damaged = blocks;
+            memset(&damaged[field], 0xff, 4);
+            Check(!DecodeAll(damaged, records), name + " with a huge length at " + to_string(field) + " decode");
+            Check(!ReadAll(damaged, 4096, records), name + " with a huge length at " + to_string(field) + " are read");
+        }
+    }
+}
+
+// File whose reads fail from a given offset on
+class FailingInputFile : public MemoryInputFile
+{
+    int64_t failFrom;
+
+public:
+    FailingInputFile(const string &data, int64_t failFrom) : MemoryInputFile(data), failFrom(failFrom) {}
+
+    int64_t Read(int64_t offset, char *buffer, int64_t length) override
+    {
+        return offset + length > failFrom ? -1 : MemoryInputFile::Read(offset, buffer, length);
+    }
+};
+
+// PrefetchReader hands out the bytes of its range exactly once and in order, however Next and Read calls of random
+// lengths are mixed, for ranges starting and ending anywhere, buffer sizes below, at and above the minimum, and files
+// read or mapped. Its position follows every call, and a failed read ends the range as failed.
+static void TestPrefetchReader()
+{
+    mt19937 random(2028);
+    string data = RandomBuffer(random, 100 * 1024, "");
+    for (bool mapped : {false, true})
+    {
+        MemoryInputFile file(data, mapped);
+        for (int64_t bufferSize : {1, 4096, 10000, 1 << 20})
+        {
+            for (int round = 0; round < 20; round++)
+            {
+                int64_t start = random() % 4 ? random() % data.size() : 0;
+                int64_t end = random() % 4 ? start + random() % (data.size() - start + 1) : data.size() + 100;
+                PrefetchReader reader(file, start, end, bufferSize);
+                string name = string("PrefetchReader of ") + (mapped ? "a mapped" : "a read") + " file with buffers of " + to_string(bufferSize) +
+                              " over " + to_string(start) + " to " + to_string(end);
+                string read;
+                while (true)
+                {
+                    if (random() % 2)
+                    {
+                        const char *buffer;
+                        int64_t length;
+                        if (!reader.Next(buffer, length))
+                            break;
+                        read.append(buffer, length);
+                    }
+                    else
+                    {
+                        string bytes(random() % 20000, '\0');
+                        int64_t length = reader.Read(&bytes[0], bytes.size());
+                        read.append(bytes, 0, length);
+                        if (length < bytes.size())
+                            break;
+                    }
+                    Check(reader.Position() == start + read.size(), name + " is at " + to_string(reader.Position()) + " after " + to_string(read.size()) + " bytes");
+                }
+                Check(!reader.Failed(), name + " failed");
+                Check(read == data.substr(start, min<int64_t>(end, data.size()) - start), name + " read other bytes");
+                Check(reader.End() == min<int64_t>(end, data.size()), name + " ends at " + to_string(reader.End()));
+            }
+        }
+    }
+    FailingInputFile failing(data, 50 * 1024);
+    PrefetchReader reader(failing, 0, data.size(), 4096);
+    const char *buffer;
+    int64_t length;
+    int64_t total = 0;
+    while (reader.Next(buffer, length))
+        total += length;
+    Check(reader.Failed() && total <= 50 * 1024, "PrefetchReader of a file failing part way read " + to_string(total) + " bytes without failing");
+}
+
+// Storage::Create gives nullptr for malformed specifications instead of throwing, and the local backend lists the root
+// for an empty path
+static void TestStorageCreate()
+{
+    for (string spec : {"hdfs:namenode:port", "hdfs:namenode:", "hdfs:namenode:9870x", "hdfs:namenode:-1", "hdfs:namenode:70000",
+                        "hdfs:namenode:99999999999999999999", "hdfs:9870", "local:", "nfs:/mnt"})
+        Check(!Storage::Create(spec), "Storage for " + spec + " was created");
+    for (string spec : {"hdfs", "hdfs:namenode:9870", "local:/"})
+        Check(Storage::Create(spec) != nullptr, "Storage for " + spec + " was not created");
+
+    char root[] = "/tmp/mapreduce-tests-XXXXXX";
+    if (!mkdtemp(root))
+    {
+        Check(false, "Failed to create a temporary directory");
+        return;
+    }
+    unique_ptr<Storage> storage = Storage::Create(string("local:") + root);
+    unique_ptr<OutputFile> file = storage->OpenOutput("/listed.txt");
+    Check(file && file->Close(), "Failed to write a file below " + string(root));
+    vector<FileInfo> entries;
+    Check(storage->ListDirectory("", entries) && entries.size() == 1 && entries[0].path == "/listed.txt", "Listing an empty path did not list the root");
+    storage->Delete("/listed.txt");
+    rmdir(root);
+}
+
+class MemoryOutputFile : public OutputFile
+{
+public:
+    string data;
+
+    bool Write(const char *bytes, int64_t length) override
+    {
+        data.append(bytes, length);
+        return true;
+    }
+
+    bool Close() override { return true; }
+};
+
+// Counts of the words of the files, looked at one byte at a time
+static map<string, int64_t> CountWordsOnce(const vector<string> &files, const DelimiterSet &delimiters)
+{
+    map<string, int64_t> counts;
+    for (auto &file : files)
+    {
+        string word;
+        for (char c : file)
+        {
+            if (!delimiters.Contains(c))
+                word += c;
+            else if (!word.empty())
+            {
+                ++counts[word];
+                word.clear();
+            }
+        }
+        if (!word.empty())
+            ++counts[word];
+    }
+    return counts;
+}
+
+// CountWords over a chunk of several files cut into ranges at random offsets, one thread per range as in a map task,
+// counts every word of the files once: the word a range starts in the middle of is left to the range before, the last
+// word of a range is finished from the bytes after it, also when it is longer than the overlap read for it, and
+// buffers of the prefetching reader end anywhere in a word. Compared with a single pass over the files for several
+// read buffer sizes, numbers of threads, combiner budgets, and with the files read or mapped.
+static void TestCountWords()
+{
+    mt19937 random(2027);
+    for (string delimiters : {string(DelimiterSet::whitespace), string(DelimiterSet::whitespace) + DelimiterSet::punctuation})
+    {
+        DelimiterSet delimiterSet(delimiters);
+        // Files of random words, an empty one and one that is all a word longer than the overlap, the chunk of a task
+        // lays them end to end
+        vector<string> files = {RandomBuffer(random, 48 * 1024, delimiters), "", "ab", string(70 * 1024, 'w'),
+                                RandomBuffer(random, 8 * 1024, delimiters) + string(70 * 1024, 'z') + RandomBuffer(random, 8 * 1024, delimiters)};
+        map<string, int64_t> expected = CountWordsOnce(files, delimiterSet);
+        int64_t totalSize = 0;
+        for (auto &file : files)
+            totalSize += file.size();
+        for (bool mapped : {false, true})
+        {
+            vector<unique_ptr<MemoryInputFile>> inputs;
+            for (auto &file : files)
+                inputs.emplace_back(new MemoryInputFile(file, mapped));
+            for (int64_t bufferSize : {4096, 5000, 1 << 20})
+            {
+                for (int numOfThreads : {1, 2, 3, 8, 32})
+                {
+                    for (int64_t budget : {0, 256 * 1024})
+                    {
+                        if (mapped && bufferSize != 4096)
+                            continue; // A mapped file is counted in one buffer whatever its size
+                        vector<int64_t> cuts = {0, totalSize};
+                        for (int i = 1; i < numOfThreads; i++)
+                            cuts.push_back(random() % totalSize);
+                        sort(cuts.begin(), cuts.end());
+
+                        const int numOfPartitions = 3;
+                        vector<unique_ptr<OutputFile>> outputFiles;
+                        for (int i = 0; i < numOfPartitions; i++)
+                            outputFiles.emplace_back(new MemoryOutputFile());
+                        MapOutput output(outputFiles, CODEC_NONE);
+                        vector<TaskCounters> counters(numOfThreads);
+                        vector<char> succeeded(numOfThreads);
+                        vector<thread> threads;
+                        for (int t = 0; t < numOfThreads; t++)
+                        {
+                            threads.emplace_back([&, t]()
+                                                 {
+                                                     Combiner combiner(output, budget, counters[t]);
+                                                     bool success = true;
+                                                     int64_t position = 0;
+                                                     for (auto &input : inputs)
+                                                     {
+                                                         int64_t start = max(cuts[t], position);
+                                                         int64_t end = min(cuts[t + 1], position + input->Size());
+                                                         if (start < end)
+                                                             success = CountWords(*input, start - position, end - position, bufferSize, delimiterSet, combiner, counters[t]) && success;
+                                                         position += input->Size();
+                                                     }
+                                                     combiner.Flush();
+                                                     succeeded[t] = success; });
+                        }
+                        for (auto &thread : threads)
+                            thread.join();
+
+                        map<string, int64_t> counted;
+                        int64_t wordsRead = 0;
+                        bool decoded = true;
+                        for (auto &file : outputFiles)
+                        {
+                            Records records;
+                            decoded = DecodeAll(static_cast<MemoryOutputFile &>(*file).data, records) && decoded;
+                            for (auto &record : records)
+                                counted[record.first] += record.second;
+                        }
+                        for (int t = 0; t < numOfThreads; t++)
+                        {
+                            decoded = decoded && succeeded[t];
+                            wordsRead += counters[t].recordsRead;
+                        }
+                        string name = "CountWords with " + to_string(delimiters.size()) + " delimiters, " + (mapped ? "mapped" : "read") + ", buffers of " +
+                                      to_string(bufferSize) + ", " + to_string(numOfThreads) + " threads and a budget of " + to_string(budget);
+                        Check(decoded, name + " failed");
+                        Check(counted == expected, name + " counts differ");
+                        int64_t expectedWords = 0;
+                        for (auto &word : expected)
+                            expectedWords += word.second;
+                        Check(wordsRead == expectedWords, name + " read " + to_string(wordsRead) + " words instead of " + to_string(expectedWords));
+                    }
+                }
+            }
+        }
+    }
+}
+
+int main()
+{
+    TestDelimiterScanners();
+    TestWordCountTable();
+    TestRecordBlocks();
+    TestPrefetchReader();
+    TestStorageCreate();
+    TestCountWords();
+    cout << (failures ? "Tests failed: " + to_string(failures) + " checks" : string("All tests passed")) << endl;
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,80 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Fixed number of worker threads executing submitted jobs in FIFO order. Shared by all tasks running on a slave so
+// the total number of busy threads never exceeds the pool size.
+class ThreadPool
+{
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> jobs;
+    std::mutex jobsMutex;
+    std::condition_variable jobsAvailable;
+    bool stopping;
+
+    void Work()
+    {
+        while (true)
+        {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(jobsMutex);
+                jobsAvailable.wait(lock, [this]()
+                                   { return stopping || !jobs.empty(); });
+                if (stopping && jobs.empty())
+                    return;
+                job = std::move(jobs.front());
+                jobs.pop();
+            }
+            job();
+        }
+    }
+
+public:
+    explicit ThreadPool(int numOfThreads) : stopping(false)
+    {
+        if (numOfThreads < 1)
+            numOfThreads = 1;
+        for (int i = 0; i < numOfThreads; i++)
+            workers.emplace_back(&ThreadPool::Work, this);
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(jobsMutex);
+            stopping = true;
+        }
+        jobsAvailable.notify_all();
+        for (auto &worker : workers)
+            worker.join();
+    }
+
+    int Size() const { return workers.size(); }
+
+    // Queuing a job, the returned future becomes ready (or holds the job's exception) once the job has run
+    template <typename Function>
+    std::future<typename std::result_of<Function()>::type> Submit(Function function)
+    {
+        typedef typename std::result_of<Function()>::type Result;
+        auto job = std::make_shared<std::packaged_task<Result()>>(std::move(function));
+        std::future<Result> result = job->get_future();
+        {
+            std::lock_guard<std::mutex> lock(jobsMutex);
+            jobs.push([job]()
+                      { (*job)(); });
+        }
+        jobsAvailable.notify_one();
+        return result;
+    }
+};
+
+#endif
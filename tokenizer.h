@@ -0,0 +1,147 @@
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TOKENIZER_X86 1
+#endif
+
+// Set of bytes separating words, with a scanner finding the next delimiter (or the next byte that is not one) in a
+// buffer. The scanner is picked once at construction for the CPU it runs on: AVX2 classifies 32 bytes at a time with
+// a nibble lookup, SSE2 compares 16 bytes against every delimiter and the scalar fallback looks each byte up in a table.
+class DelimiterSet
+{
+public:
+    // Word separators used when a job does not add any of its own
+    static constexpr const char *whitespace = " \t\n\r\v\f";
+    static constexpr const char *punctuation = "!\"#$%&'()*+,-./:;<=>?@[\\]^_`{|}~";
+
+    // Scanner implementations, BEST picks the fastest one the CPU and the delimiters allow
+    enum Implementation
+    {
+        BEST,
+        SCALAR,
+        SSE2,
+        AVX2,
+    };
+
+    explicit DelimiterSet(const std::string &delimiters = whitespace, Implementation implementation = BEST) : delimiters(delimiters), ascii(true)
+    {
+        memset(table, 0, sizeof(table));
+        memset(lowNibbles, 0, sizeof(lowNibbles));
+        memset(highNibbles, 0, sizeof(highNibbles));
+        for (unsigned char c : delimiters)
+        {
+            table[c] = true;
+            if (c >= 0x80)
+                ascii = false;
+            else
+                lowNibbles[c & 0x0f] |= 1 << (c >> 4);
+        }
+        for (int i = 0; i < 8; i++)
+            highNibbles[i] = 1 << i;
+
+        scan = &DelimiterSet::ScanScalar;
+#ifdef TOKENIZER_X86
+        // The nibble lookup only encodes bytes below 0x80, sets with other bytes are compared one delimiter at a time
+        if (Supports(AVX2) && (implementation == BEST || implementation == AVX2))
+            scan = &DelimiterSet::ScanAvx2;
+        else if (Supports(SSE2) && (implementation == BEST || implementation == SSE2))
+            scan = &DelimiterSet::ScanSse2;
+#endif
+    }
+
+    // Whether an implementation can be used for this set on this CPU, asking for one that can not be used gives the
+    // scalar scanner
+    bool Supports(Implementation implementation) const
+    {
+#ifdef TOKENIZER_X86
+        if (implementation == AVX2)
+            return ascii && __builtin_cpu_supports("avx2");
+        if (implementation == SSE2)
+            return delimiters.size() <= maxSse2Delimiters;
+#endif
+        return implementation == SCALAR || implementation == BEST;
+    }
+
+    bool Contains(char c) const { return table[(unsigned char)c]; }
+
+    const std::string &Delimiters() const { return delimiters; }
+
+    // Offset of the first delimiter in data, length if there is none
+    size_t FindDelimiter(const char *data, size_t length) const { return (this->*scan)(data, length, true); }
+
+    // Offset of the first byte that is not a delimiter, length if there is none
+    size_t FindNonDelimiter(const char *data, size_t length) const { return (this->*scan)(data, length, false); }
+
+private:
+    static const size_t maxSse2Delimiters = 8;
+
+    std::string delimiters;
+    bool ascii;
+    bool table[256];
+    // For a delimiter c, bit (c >> 4) of lowNibbles[c & 0x0f] is set, a byte is a delimiter if its low nibble entry
+    // has the bit of its high nibble set
+    alignas(16) uint8_t lowNibbles[16];
+    alignas(16) uint8_t highNibbles[16];
+    size_t (DelimiterSet::*scan)(const char *, size_t, bool) const;
+
+    size_t ScanScalar(const char *data, size_t length, bool delimiter) const
+    {
+        for (size_t i = 0; i < length; i++)
+        {
+            if (table[(unsigned char)data[i]] == delimiter)
+                return i;
+        }
+        return length;
+    }
+
+#ifdef TOKENIZER_X86
+    __attribute__((target("sse2"))) size_t ScanSse2(const char *data, size_t length, bool delimiter) const
+    {
+        size_t i = 0;
+        for (; i + 16 <= length; i += 16)
+        {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+            __m128i matches = _mm_setzero_si128();
+            for (char c : delimiters)
+                matches = _mm_or_si128(matches, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(c)));
+            uint32_t mask = _mm_movemask_epi8(matches);
+            if (!delimiter)
+                mask = ~mask & 0xffff;
+            if (mask)
+                return i + __builtin_ctz(mask);
+        }
+        return i + ScanScalar(data + i, length - i, delimiter);
+    }
+
+    __attribute__((target("avx2"))) size_t ScanAvx2(const char *data, size_t length, bool delimiter) const
+    {
+        const __m256i lowTable = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(lowNibbles)));
+        const __m256i highTable = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(highNibbles)));
+        const __m256i nibbleMask = _mm256_set1_epi8(0x0f);
+        size_t i = 0;
+        for (; i + 32 <= length; i += 32)
+        {
+            __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+            // High nibbles 8 to 15 have no entry in highTable, so bytes of 0x80 and above never match
+            __m256i low = _mm256_shuffle_epi8(lowTable, _mm256_and_si256(bytes, nibbleMask));
+            __m256i high = _mm256_shuffle_epi8(highTable, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibbleMask));
+            __m256i nonMatches = _mm256_cmpeq_epi8(_mm256_and_si256(low, high), _mm256_setzero_si256());
+            uint32_t mask = _mm256_movemask_epi8(nonMatches);
+            if (delimiter)
+                mask = ~mask;
+            if (mask)
+                return i + __builtin_ctz(mask);
+        }
+        return i + ScanScalar(data + i, length - i, delimiter);
+    }
+#endif
+};
+
+#endif
@@ -0,0 +1,137 @@
+#include "wordcount.h"
+
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+
+int PartitionOf(string_view word, int numOfPartitions)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : word)
+    {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash % numOfPartitions;
+}
+
+bool CountWords(InputFile &input_file, int64_t start, int64_t end, int64_t bufferSize, const DelimiterSet &delimiters, Combiner &combiner, TaskCounters &counters)
+{
+    int64_t fileSize = input_file.Size();
+    end = min(end, fileSize);
+    if (start >= end)
+        return true;
+
+    // Case 1: if start of range is in the middle of a word then that word is skipped. The byte before the range tells,
+    // so it is read together with the range.
+    bool checkPrevious = start > 0;
+    bool skipping = false;
+    PrefetchReader reader(input_file, checkPrevious ? start - 1 : start, end, bufferSize);
+    string word; // Beginning of a word cut by the end of the previous buffer
+    int64_t words = 0;
+
+    // Words of a buffer are collected in batches and handed to the combiner together, so the time spent tokenizing and
+    // the time spent aggregating can be told apart with two clock reads per batch
+    const int batchCapacity = 256;
+    string_view batch[batchCapacity];
+    int batchSize = 0;
+    auto addBatch = [&]()
+    {
+        auto aggregateStart = chrono::steady_clock::now();
+        int64_t writeNanos = counters.writeNanos;
+        for (int i = 0; i < batchSize; i++)
+            combiner.Add(batch[i]);
+        counters.aggregateNanos += NanosSince(aggregateStart) - (counters.writeNanos - writeNanos);
+        words += batchSize;
+        batchSize = 0;
+    };
+    auto countBuffer = [&](const char *buffer, int64_t length)
+    {
+        int64_t i = 0;
+        if (checkPrevious)
+        {
+            skipping = !delimiters.Contains(buffer[0]);
+            checkPrevious = false;
+            i = 1;
+        }
+        if (skipping || !word.empty())
+        {
+            int64_t wordEnd = i + delimiters.FindDelimiter(buffer + i, length - i);
+            if (!skipping)
+                word.append(buffer + i, wordEnd - i);
+            if (wordEnd == length)
+                return;
+            if (!skipping)
+            {
+                combiner.Add(word);
+                ++words;
+            }
+            skipping = false;
+            word.clear();
+            i = wordEnd;
+        }
+        while (true)
+        {
+            i += delimiters.FindNonDelimiter(buffer + i, length - i);
+            if (i == length)
+                break;
+            int64_t wordEnd = i + delimiters.FindDelimiter(buffer + i, length - i);
+            if (wordEnd == length)
+            {
+                word.assign(buffer + i, length - i);
+                break;
+            }
+            batch[batchSize++] = string_view(buffer + i, wordEnd - i);
+            if (batchSize == batchCapacity)
+                addBatch();
+            i = wordEnd;
+        }
+        addBatch(); // The views point into the buffer, which the next call to Next replaces
+    };
+    const char *buffer;
+    int64_t length;
+    while (true)
+    {
+        auto readStart = chrono::steady_clock::now();
+        if (!reader.Next(buffer, length))
+            break;
+        counters.readNanos += NanosSince(readStart);
+        counters.bytesRead += length;
+        // The time of a buffer is tokenizing, except for what the combiner has spent aggregating and writing
+        auto bufferStart = chrono::steady_clock::now();
+        int64_t combinerNanos = counters.aggregateNanos + counters.writeNanos;
+        countBuffer(buffer, length);
+        counters.tokenizeNanos += NanosSince(bufferStart) - (counters.aggregateNanos + counters.writeNanos - combinerNanos);
+    }
+    counters.recordsRead += words;
+    counters.UpdatePeakMemory(reader.BufferMemory()); // Ranges counted one after the other reuse the memory
+    if (reader.Failed())
+        return false;
+
+    // Case 2: a word that was started before end is completed from the bytes after the range, read in one go unless
+    // the word is longer than the overlap
+    const int64_t overlapSize = 64 * 1024;
+    vector<char> overlap;
+    {
+        PhaseTimer overlapTimer(counters.readNanos);
+        for (int64_t position = end; !word.empty() && position < fileSize;)
+        {
+            overlap.resize(min(overlapSize, fileSize - position));
+            int64_t bytesRead = input_file.Read(position, overlap.data(), overlap.size());
+            if (bytesRead <= 0)
+                return false;
+            int64_t wordEnd = delimiters.FindDelimiter(overlap.data(), bytesRead);
+            word.append(overlap.data(), wordEnd);
+            if (wordEnd < bytesRead)
+                break;
+            position += bytesRead;
+        }
+    }
+    if (!word.empty())
+    {
+        combiner.Add(word);
+        ++counters.recordsRead;
+    }
+    return true;
+}
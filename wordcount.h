@@ -0,0 +1,152 @@
+#ifndef WORDCOUNT_H
+#define WORDCOUNT_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "record_block.h"
+#include "storage.h"
+#include "task_metrics.h"
+#include "tokenizer.h"
+#include "wordcount_table.h"
+
+// Word counting of map tasks: the input is tokenized, aggregated by a combiner per thread and written as partitioned
+// record blocks
+
+// Hash partitioning of words between reducers. FNV-1a is used instead of std::hash so that every slave computes the
+// same partition for a word regardless of its standard library.
+int PartitionOf(std::string_view word, int numOfPartitions);
+
+// Partitioner deciding which reducer a word belongs to. Without split points words are hash partitioned. With the
+// numOfPartitions - 1 split points of a job (sorted), words are range partitioned: partition i holds the words from
+// split point i - 1 up to, but not including, split point i, so the sorted outputs of the reducers read one after
+// the other are sorted as a whole.
+class Partitioner
+{
+    int numOfPartitions;
+    std::vector<std::string> splitPoints;
+
+public:
+    Partitioner(int numOfPartitions, std::vector<std::string> splitPoints = {}) : numOfPartitions(numOfPartitions), splitPoints(std::move(splitPoints)) {}
+
+    int PartitionOf(std::string_view word) const
+    {
+        if (splitPoints.empty())
+            return ::PartitionOf(word, numOfPartitions);
+        return std::upper_bound(splitPoints.begin(), splitPoints.end(), word, [](std::string_view word, const std::string &splitPoint)
+                                { return word < splitPoint; }) -
+               splitPoints.begin();
+    }
+};
+
+// Partitioned map output shared by all threads of a map task. Threads hand over whole record blocks, so the lock is
+// taken once per block rather than once per word and blocks of different threads never interleave.
+class MapOutput
+{
+    std::vector<std::unique_ptr<OutputFile>> &output_files;
+    std::vector<std::mutex> fileMutexes;
+    std::atomic<bool> failed;
+    BlockCodec codec;
+    Partitioner partitioner;
+
+public:
+    MapOutput(std::vector<std::unique_ptr<OutputFile>> &output_files, BlockCodec codec, std::vector<std::string> splitPoints = {})
+        : output_files(output_files), fileMutexes(output_files.size()), failed(false), codec(codec), partitioner(output_files.size(), std::move(splitPoints)) {}
+
+    int NumOfPartitions() { return output_files.size(); }
+
+    int PartitionOf(std::string_view word) const { return partitioner.PartitionOf(word); }
+
+    BlockCodec Codec() { return codec; }
+
+    void Append(int partition, const std::string &blocks)
+    {
+        std::lock_guard<std::mutex> lock(fileMutexes[partition]);
+        if (!output_files[partition]->Write(blocks.data(), blocks.size()))
+            failed = true;
+    }
+
+    bool Failed() { return failed; }
+};
+
+// In-mapper combiner: aggregates (word, count) pairs of one map thread in memory and writes them as records to the
+// partition of the word whenever the memory budget is full. With a budget of 0 every word is passed
+// through with a count of 1. Time spent encoding and writing blocks is added to the counters of the thread.
+class Combiner
+{
+    MapOutput &output;
+    int64_t budget;
+    TaskCounters &counters;
+    WordCountTable counts;
+    std::vector<RecordBlockBuilder> outputBlocks;
+    std::string encodedBlock;
+    int64_t peakMemory;
+
+    // Raw size of the records collected in a block before it is encoded and written
+    static constexpr size_t outputBlockSize = 64 * 1024;
+
+    void Write(std::string_view word, int64_t count)
+    {
+        int partition = output.PartitionOf(word);
+        outputBlocks[partition].Add(word, count);
+        if (outputBlocks[partition].RawSize() >= outputBlockSize)
+            FlushBuffer(partition);
+    }
+
+    void FlushBuffer(int partition)
+    {
+        if (outputBlocks[partition].RecordCount() == 0)
+            return;
+        PhaseTimer timer(counters.writeNanos);
+        counters.recordsEmitted += outputBlocks[partition].RecordCount();
+        encodedBlock.clear();
+        outputBlocks[partition].Finish(output.Codec(), encodedBlock);
+        output.Append(partition, encodedBlock);
+        counters.bytesWritten += encodedBlock.size();
+    }
+
+public:
+    Combiner(MapOutput &output, int64_t budget, TaskCounters &counters) : output(output), budget(budget), counters(counters), outputBlocks(output.NumOfPartitions()), peakMemory(0) {}
+
+    void Add(std::string_view word)
+    {
+        if (budget <= 0)
+        {
+            Write(word, 1);
+            return;
+        }
+        counts.Add(word);
+        if (counts.MemoryUsed() >= budget)
+            Flush();
+    }
+
+    // Writing all aggregated counts to the partition files and releasing the memory
+    void Flush()
+    {
+        peakMemory = std::max(peakMemory, counts.MemoryUsed());
+        counts.ForEach([this](std::string_view word, int64_t count)
+                       { Write(word, count); });
+        counts.Clear();
+        for (int i = 0; i < outputBlocks.size(); i++)
+            FlushBuffer(i);
+    }
+
+    // Bytes of the word counts at their largest
+    int64_t PeakMemory() const { return peakMemory; }
+};
+
+// Counting the words that start inside [start, end) of the input file. A word running past end is completed from the
+// following bytes and a word that started before start is skipped, as it belongs to the range before. This way
+// adjacent ranges split on arbitrary offsets still count every word exactly once.
+// The range is read in buffers of bufferSize bytes, prefetched while the words of the previous buffer are counted.
+// Words are handed to the combiner as views into the buffer, only a word cut by the end of a buffer is copied.
+// Bytes and words read and the time spent reading and tokenizing are added to counters.
+bool CountWords(InputFile &input_file, int64_t start, int64_t end, int64_t bufferSize, const DelimiterSet &delimiters, Combiner &combiner, TaskCounters &counters);
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef WORDCOUNT_TABLE_H
+#define WORDCOUNT_TABLE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Hash table counting words, built for the aggregation in map and reduce tasks. Slots are kept in one array probed
+// linearly and store the hash of their word, so most mismatches are rejected without touching the key. Key bytes are
+// copied into large arena blocks instead of one allocation per word, and lookups take a string_view so words can be
+// counted straight from a read buffer. The table is unordered, Sorted() orders it once when the result is written.
+class WordCountTable
+{
+    struct Slot
+    {
+        uint64_t hash;
+        const char *key; // nullptr for an empty slot
+        uint32_t length;
+        int64_t count;
+    };
+
+    std::vector<Slot> slots;
+    size_t numOfWords;
+    std::vector<std::unique_ptr<char[]>> arenaBlocks;
+    char *arenaPosition;
+    size_t arenaLeft;
+    int64_t arenaUsed;
+
+    static constexpr size_t initialCapacity = 1024;
+    static constexpr size_t arenaBlockSize = 64 * 1024;
+
+    static uint64_t Hash(std::string_view word) { return std::hash<std::string_view>()(word); }
+
+    const char *CopyKey(std::string_view word)
+    {
+        // An empty word has no bytes to copy, but its key must still tell its slot from an empty one
+        if (word.empty())
+            return "";
+        if (word.size() > arenaLeft)
+        {
+            size_t blockSize = std::max(arenaBlockSize, word.size());
+            arenaBlocks.emplace_back(new char[blockSize]);
+            arenaPosition = arenaBlocks.back().get();
+            arenaLeft = blockSize;
+            arenaUsed += blockSize;
+        }
+        char *key = arenaPosition;
+        memcpy(key, word.data(), word.size());
+        arenaPosition += word.size();
+        arenaLeft -= word.size();
+        return key;
+    }
+
+    // Doubling the slots once they are 70% full, keys stay where they are in the arena
+    void Grow()
+    {
+        std::vector<Slot> oldSlots(slots.size() * 2, Slot{0, nullptr, 0, 0});
+        oldSlots.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (auto &slot : oldSlots)
+        {
+            if (!slot.key)
+                continue;
+            size_t i = slot.hash & mask;
+            while (slots[i].key)
+                i = (i + 1) & mask;
+            slots[i] = slot;
+        }
+    }
+
+public:
+    WordCountTable() : slots(initialCapacity, Slot{0, nullptr, 0, 0}), numOfWords(0), arenaPosition(nullptr), arenaLeft(0), arenaUsed(0) {}
+
+    // Adding count to the count of word, the word is copied on its first occurrence
+    void Add(std::string_view word, int64_t count = 1)
+    {
+        uint64_t hash = Hash(word);
+        size_t mask = slots.size() - 1;
+        size_t i = hash & mask;
+        while (slots[i].key)
+        {
+            Slot &slot = slots[i];
+            if (slot.hash == hash && slot.length == word.size() && memcmp(slot.key, word.data(), word.size()) == 0)
+            {
+                slot.count += count;
+                return;
+            }
+            i = (i + 1) & mask;
+        }
+        slots[i] = Slot{hash, CopyKey(word), (uint32_t)word.size(), count};
+        if (++numOfWords * 10 > slots.size() * 7)
+            Grow();
+    }
+
+    size_t Size() const { return numOfWords; }
+
+    // Bytes held by the slots and the key arena
+    int64_t MemoryUsed() const { return slots.size() * sizeof(Slot) + arenaUsed; }
+
+    // Calling function(word, count) for every word in no particular order
+    template <typename Function>
+    void ForEach(Function function) const
+    {
+        for (auto &slot : slots)
+        {
+            if (slot.key)
+                function(std::string_view(slot.key, slot.length), slot.count);
+        }
+    }
+
+    // Words and their counts in ascending order of the words. The views stay valid until the table is cleared.
+    std::vector<std::pair<std::string_view, int64_t>> Sorted() const
+    {
+        std::vector<std::pair<std::string_view, int64_t>> words;
+        words.reserve(numOfWords);
+        ForEach([&words](std::string_view word, int64_t count)
+                { words.emplace_back(word, count); });
+        std::sort(words.begin(), words.end());
+        return words;
+    }
+
+    // Removing all words and releasing their memory
+    void Clear()
+    {
+        std::vector<Slot>(initialCapacity, Slot{0, nullptr, 0, 0}).swap(slots);
+        numOfWords = 0;
+        arenaBlocks.clear();
+        arenaPosition = nullptr;
+        arenaLeft = 0;
+        arenaUsed = 0;
+    }
+};
+
+#endif